@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "btreestore.h"
+
+/*
+    Microbenchmark for the in-node key search and for lookups through the tree.
+        1. For one node of branching b (b - 1 sorted keys), time every search strategy.
+        2. For a tree of branching b, time btree_retrieve on random existing keys.
+    Build with `make bench`, it is built optimized with its own flags, `make bench KEY_BITS=64` times 64 bit keys.
+*/
+
+#define NUM_PROBES 200000
+#define NUM_TREE_KEYS 20000
+#define NUM_TREE_PROBES 200000
+
+typedef uint16_t (*search_function)(const btree_key_t * keys, uint16_t n, btree_key_t key);
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_search(search_function search, const btree_key_t * keys, uint16_t n, const btree_key_t * probes){
+    volatile uint32_t sink = 0;
+    double start = now_ns();
+    for (int i = 0; i < NUM_PROBES; i++){
+        sink += search(keys, n, *(probes + i));
+    }
+    double end = now_ns();
+    (void) sink;
+    return (end - start) / NUM_PROBES;
+}
+
+static void bench_node_search(uint16_t branching){
+    uint16_t n = branching - 1;
+    btree_key_t * keys = (btree_key_t *) malloc(sizeof(btree_key_t) * branching);
+    btree_key_t * probes = (btree_key_t *) malloc(sizeof(btree_key_t) * NUM_PROBES);
+
+    // keys 0, 3, 6 ..., probes hit both existing keys and gaps
+    for (uint16_t i = 0; i < n; i++){
+        *(keys + i) = i * 3;
+    }
+    for (int i = 0; i < NUM_PROBES; i++){
+        *(probes + i) = rand() % (n * 3 + 1);
+    }
+
+    printf("%9u %10.2f %10.2f", branching,
+        time_search(&linear_search_keys, keys, n, probes),
+        time_search(&binary_search_keys, keys, n, probes));
+#ifdef HAVE_AVX2_KEY_SEARCH
+    if (__builtin_cpu_supports("avx2")){
+        printf(" %10.2f", time_search(&avx2_search_keys, keys, n, probes));
+    }else{
+        printf(" %10s", "n/a");
+    }
+#else
+    printf(" %10s", "n/a");
+#endif
+    printf(" %10.2f\n", time_search(&search_keys, keys, n, probes));
+
+    free(keys);
+    free(probes);
+}
+
+static void bench_tree_retrieve(uint16_t branching){
+    uint32_t encryption_key[4] = {0x12345678, 0x23456789, 0x3456789A, 0x456789AB};
+    void * helper = init_store(branching, 4);
+    btree_key_t * probes = (btree_key_t *) malloc(sizeof(btree_key_t) * NUM_TREE_PROBES);
+
+    for (uint32_t i = 0; i < NUM_TREE_KEYS; i++){
+        btree_insert(i * 7, "a", 2, encryption_key, 0x1234, helper);
+    }
+    for (int i = 0; i < NUM_TREE_PROBES; i++){
+        *(probes + i) = (rand() % NUM_TREE_KEYS) * 7;
+    }
+
+    struct info found;
+    double start = now_ns();
+    for (int i = 0; i < NUM_TREE_PROBES; i++){
+        btree_retrieve(*(probes + i), &found, helper);
+    }
+    double end = now_ns();
+    printf("%9u %10.2f\n", branching, (end - start) / NUM_TREE_PROBES);
+
+    free(probes);
+    close_store(helper);
+}
+
+int main(void){
+    srand(2017);
+
+    printf("in-node search, ns per search\n");
+    printf("%9s %10s %10s %10s %10s\n", "branching", "linear", "binary", "avx2", "search");
+    for (uint32_t branching = 4; branching <= 1024; branching *= 2){
+        bench_node_search(branching);
+    }
+
+    printf("\nbtree_retrieve on %d keys, ns per lookup\n", NUM_TREE_KEYS);
+    printf("%9s %10s\n", "branching", "retrieve");
+    for (uint32_t branching = 4; branching <= 1024; branching *= 2){
+        bench_tree_retrieve(branching);
+    }
+    return 0;
+}
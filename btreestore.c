@@ -1,120 +1,339 @@
 #include "btreestore.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#ifdef HAVE_AVX2_KEY_SEARCH
+#include <immintrin.h>
+#endif
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// the last leaf this thread inserted into, see finger_descend
+static __thread struct finger finger;
+// the ciphertext btree_update copies under the lock, see update_buffer
+static pthread_key_t update_buffer_key;
+static pthread_once_t update_buffer_once = PTHREAD_ONCE_INIT;
+static uint64_t next_store_id = 1;
 
 
 /*              
     Main idea:
             For the structure:
-                1. The address of root is recorded in heap
+                1. The address of root is recorded in the store header returned by init_store
                 2. For every node   
                     + num_children;
                     + num_keys;
-                    + uint32_t * keys
-                    + struct info ** keys_info; (key_info is an array of pointers, each pointer ponits to a strcut info)
-                    + struct Btree_Node ** children; (children is an array of pointers, each poniter ponits to a Btree_Node )
-                    + struct Btree_Node * parent;
+                    + btree_key_t * keys; (32, 64 or 128 bit keys, chosen by BTREE_KEY_BITS at compile time)
+                    + uint32_t index; (the index of the node in the node arena)
+                    + struct info * keys_info; (key_info is an array of struct info, stored by value next to the keys)
+                    + uint32_t * children; (children is an array of node indices, NO_NODE in a leaf)
+                   There is no parent pointer, insert and delete keep the nodes they walked through
+                   and the child slot taken at every level in a descent path and go back up through it,
+                   so no children array is ever searched for a child.
+                3. One node is one cache line aligned block, the arrays follow the header inside it
+                    | header | keys[b] | keys_info[b] | children[b + 1] |
+                   The size of the block only depends on branching, it is recorded in the helper by init_store.
+                4. Nodes live in a per-store node arena (address in the store header)
+                    + the arena is a list of 64 KiB chunks, node i is at chunk i / nodes_per_chunk
+                    + chunks never move, so a node keeps its address while the arena grows
+                    + freed nodes go to a free list, linked through their indices
+                   close_store just frees the chunks.
+                5. In B+tree mode (store_config.mode) internal nodes only hold separator keys and children
+                    | header | keys[bi] | children[bi + 1] |
+                   in a block of the same size, so bi is much larger than b. Leaves hold all keys and values
+                   and are linked in key order, deletes always happen in a leaf.
+                6. Ciphertexts are appended to the segments of a per-store arena (address in the store header)
+                    | entry head (key, segment, length) | ciphertext | entry head | ciphertext | ...
+                    + struct info.data points at the ciphertext inside its segment
+                    + a value of one or two blocks is not appended, its ciphertext is kept in the slot
+                    + deleting a key only marks its entry dead
+                    + a segment with no live entries is unmapped at once, a sparse one is compacted by the
+                      maintenance thread of the store: live entries are moved to the active segment and the
+                      slots of their keys are updated, then the segment is unmapped.
+                7. btree_snapshot returns a read-only view of the tree as it is, read without the lock.
+                    + the view has its own list of the node chunks, every chunk counts the lists holding it
+                    + node_at copies a shared chunk before the store changes one of its nodes, readers use
+                      peek_node, which does not
+                    + the view pins every value segment, so no ciphertext it sees is moved or rewritten
     
             For optimization speed: 
                 1. Reduced variables so that memory load time is reduced. 
-                2. Use threads to encrypt a certain number of blocks.
+                2. Use threads to encrypt a certain number of blocks, a store made with
+                   store_config.value_mode STORE_PLAINTEXT does not encrypt at all.
+                3. Keys inside one node are searched by search_keys, which picks
+                   linear scan, AVX2 compare + movemask or binary search by node size.
+                4. With store_config.filter_bits_per_key a blocked Bloom filter of the keys answers
+                   most lookups of missing keys from one cache line, without walking the tree.
+                5. Every thread remembers the last leaf it inserted into with its key range, inserts
+                   and lookups of keys in that range do not start at the root.
+                6. With store_config.tombstone_deletes a delete only marks the slot of the key and frees
+                   the value, the maintenance thread takes the keys out of the tree in batches.
 */
 
 
 void * init_store(uint16_t branching, uint8_t n_processors) {
-    //                          branching , process, number of nodes, address of root node
-    void* heapstart = malloc(sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint16_t) + ADDRESS);
-    uint16_t * branch_ptr = (uint16_t *) heapstart;
-    * branch_ptr = branching;
-    uint8_t * processors_ptr = (u_int8_t *) (branch_ptr + 1);
-    * processors_ptr = n_processors;
+    struct store_config config;
+    memset(&config, '\0', sizeof(struct store_config));
+    config.branching = branching;
+    config.n_processors = n_processors;
+    config.mode = STORE_BTREE;
+    config.value_mode = STORE_ENCRYPTED;
+    return init_store_with_config(&config);
+}
+
+void * init_store_with_config(const struct store_config * config) {
+    // every field is aligned and the counters are 64 bits, a store is not limited by its handle
+    struct store_header * store = (struct store_header *) malloc(sizeof(struct store_header));
+    memset(store, '\0', sizeof(struct store_header));
+    store -> branching = config -> branching;
+    store -> n_processors = config -> n_processors;
+    store -> mode = config -> mode;
+    store -> value_mode = config -> value_mode;
+    store -> tombstone_deletes = config -> tombstone_deletes;
+    store -> merge_percent = config -> merge_percent;
+    store -> id = __atomic_fetch_add(&next_store_id, 1, __ATOMIC_RELAXED);
 
     // The num of nodes is 0
     // The pointer for the root is NULL;
-    memset(processors_ptr + 1, '\0', sizeof(uint16_t) + ADDRESS);
-    return heapstart;
+    store -> node_bytes = node_size(config -> branching);
+    store -> nodes = node_arena_create(store -> node_bytes);
+    store -> arena = arena_create(store);
+    if (config -> filter_bits_per_key != 0){
+        store -> filter = filter_create(config -> filter_bits_per_key, FILTER_MIN_KEYS);
+    }
+
+    // internal nodes of a B+tree fill the same block, unless a smaller fan-out is asked for
+    store -> internal_branching = internal_branching_for(store -> node_bytes);
+    if (config -> internal_branching >= 3 && config -> internal_branching < store -> internal_branching){
+        store -> internal_branching = config -> internal_branching;
+    }
+    return store;
 }
 
 void close_store(void * helper) {
-    Btree_Node * root = *((Btree_Node **) (helper + 5));
-    free_all(root);
+    if (((struct store_header *) helper) -> read_only){
+        btree_snapshot_release(helper);
+        return;
+    }
+    // every node is inside the node arena and every ciphertext inside the arena, no need to walk the tree
+    arena_destroy(((struct store_header *) helper) -> arena);
+    node_arena_destroy(((struct store_header *) helper) -> nodes);
+    filter_destroy(((struct store_header *) helper) -> filter);
     free(helper);
     helper = NULL;
     return;
 }
 
-int btree_insert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+int btree_insert(btree_key_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+    if (((struct store_header *) helper) -> read_only){
+        return 1;
+    }
+
+    uint16_t branching = ((struct store_header *) helper) -> branching;
+    struct value_arena * arena = ((struct store_header *) helper) -> arena;
+    int plaintext_values = ((struct store_header *) helper) -> value_mode == STORE_PLAINTEXT;
 
-    lock_at_start();
+    // The key_info and the ciphertext do not depend on the tree, so they are prepared
+    // before taking the lock, other threads can keep using the tree while we encrypt.
+    // The key_info is copied into the slot of the key in its node.
+    struct info new_key_info;
+ 
+    new_key_info.size = count;
+    if (plaintext_values){
+        // encryption_key and nonce are ignored, they may be NULL and 0
+        memset(new_key_info.key, '\0', sizeof(uint32_t) * 4);
+        new_key_info.nonce = 0;
+    }else{
+        memcpy(new_key_info.key, encryption_key, sizeof(uint32_t) * 4); 
+        new_key_info.nonce = nonce;
+    }
+    // count the number of blocks of plaintext
+    // one block 8 bytes    
+    uint64_t num_blocks = count_blocks(count);
 
-    uint16_t branching = * ((uint16_t * ) helper);
+    // the padded plaintext is copied into the slot or the arena and encrypted in place
+    // an arena entry stays pinned until it is in the tree, so compaction does not move it
+    uint64_t* cipher;
+    if (value_is_inline(&new_key_info)){
+        cipher = new_key_info.inline_data;
+    }else{
+        cipher = (uint64_t*) arena_append(arena, key, num_blocks * BYTES_ONE_BLOCK);
+        new_key_info.data = (void*) cipher;
+    }
+    seal_value(cipher, plaintext, count, encryption_key, nonce, helper);
+
+    lock_at_start();
 
-    Btree_Node ** root_ptr = (Btree_Node **) (helper + 5);
+    Btree_Node ** root_ptr = &((struct store_header *) helper) -> root;
 
     if (*root_ptr == NULL){
-        *root_ptr = initialize_Btree_node(branching, NULL);
-        uint16_t * num_nodes = (uint16_t *)(helper + 3); 
+        *root_ptr = allocate_node(helper);
+        uint64_t * num_nodes = &((struct store_header *) helper) -> num_nodes; 
         *(num_nodes) += 1;
+        ((struct store_header *) helper) -> structure_version += 1;
     }
-    Btree_Node * root = *root_ptr;
     // First, follow the searching algorithm to search for K in the tree. 
     // It is an error if K already exists in the tree.
-    // Identify the leaf node that would contain K
-    struct info found;
-    Btree_Node * find = recursive_find(key, &found, root);
-
-
-    if (find != NULL){
+    // Identify the leaf node that would contain K, the nodes above it are kept for the splits
+    struct descent_path path;
+    if (finger_descend(key, &path, helper) == 1){
+        // a tombstone of the key is brought back to life, the tree does not change
+        Btree_Node * found_node = path.nodes[path.depth - 1];
+        struct info * slot = found_node -> keys_info + search_keys(found_node -> keys, found_node -> num_keys, key);
+        if (is_tombstone(slot)){
+            *slot = new_key_info;
+            ((struct store_header *) helper) -> tombstones -= 1;
+            ((struct store_header *) helper) -> inserts += 1;
+            filter_add(key, helper);
+            pthread_mutex_unlock(&lock);
+            if (value_is_inline(&new_key_info) == 0){
+                arena_unpin(arena, cipher);
+            }
+            return 0;
+        }
         // if find one node successfully
         pthread_mutex_unlock(&lock);
+        if (value_is_inline(&new_key_info) == 0){
+            arena_free(arena, cipher);
+            arena_unpin(arena, cipher);
+        }
         return 1;
     }
 
-    Btree_Node * inserted_node = find_insert_node(key, root);
-
-    // malloc space for one key_info
-    struct info *new_key_info = (struct info *)malloc(sizeof(struct info));
- 
-    new_key_info -> size = count;
-    memcpy(new_key_info -> key, encryption_key, sizeof(uint32_t) * 4); 
-    new_key_info -> nonce = nonce;
-    // count the number of blocks of plaintext
-    // one block 8 bytes    
+    Btree_Node * inserted_node = path.nodes[path.depth - 1];
+    
+    add_key_in_one_node(inserted_node, key, &new_key_info);
+   
+    splitNode(&path, branching, key, helper);
+    filter_add(key, helper);
+    ((struct store_header *) helper) -> inserts += 1;
 
-    int num_blocks = count / BYTES_ONE_BLOCK;
-    if (count % BYTES_ONE_BLOCK != 0){
-        num_blocks ++;
+    pthread_mutex_unlock(&lock);
+    if (value_is_inline(&new_key_info) == 0){
+        arena_unpin(arena, cipher);
     }
+    
+    return 0;
+}
 
-    uint64_t* plain = (uint64_t*) malloc(num_blocks * 8);
-    uint64_t* cipher = (uint64_t*) malloc(num_blocks * 8);
 
-    memset(plain, '\0', num_blocks * 8);
-    memcpy(plain, plaintext, count);
+// Replace the value of an existing key, returns 1 if the key is not in the tree.
+// Only the slot of the key changes, so an update never splits or merges nodes.
+// A ciphertext that fits the arena entry of the old one is copied over it, unless a handle or a snapshot
+// may be reading it. Values with a segment of their own are encrypted into a new entry like btree_insert does.
+int btree_update(btree_key_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+    struct value_arena * arena = ((struct store_header *) helper) -> arena;
+    uint64_t num_blocks = count_blocks(count);
+    if (((struct store_header *) helper) -> read_only){
+        return 1;
+    }
 
-    encrypt_tea_ctr(plain, encryption_key, nonce, cipher, num_blocks);
-    new_key_info -> data = (void*) cipher;
-    
-    add_key_in_one_node(inserted_node, key, new_key_info);
+    struct info new_key_info;
+    new_key_info.size = count;
+    if (((struct store_header *) helper) -> value_mode == STORE_PLAINTEXT){
+        memset(new_key_info.key, '\0', sizeof(uint32_t) * 4);
+        new_key_info.nonce = 0;
+    }else{
+        memcpy(new_key_info.key, encryption_key, sizeof(uint32_t) * 4);
+        new_key_info.nonce = nonce;
+    }
+
+    // like btree_insert, the value is encrypted before taking the lock, only copying it is left for under the lock
+    uint64_t bytes = num_blocks * BYTES_ONE_BLOCK;
+    int own_entry = value_is_inline(&new_key_info) == 0 && entry_size(bytes) > SEGMENT_SIZE / 4;
+    uint64_t * cipher;
+    if (value_is_inline(&new_key_info)){
+        cipher = new_key_info.inline_data;
+    }else if (own_entry){
+        cipher = (uint64_t *) arena_append(arena, key, bytes);
+    }else{
+        cipher = update_buffer(num_blocks);
+    }
+    seal_value(cipher, plaintext, count, encryption_key, nonce, helper);
 
-    free(plain);
-  
-    plain = NULL;
-  
-   
-    splitNode(inserted_node, branching, helper);
+    lock_at_start();
+    struct info * slot = find_key_info(key, helper);
+    if (slot == NULL){
+        pthread_mutex_unlock(&lock);
+        if (own_entry){
+            arena_free(arena, cipher);
+            arena_unpin(arena, cipher);
+        }
+        return 1;
+    }
+
+    void * old_data = value_is_inline(slot) ? NULL : slot -> data;
+    if (value_is_inline(&new_key_info) == 0 && own_entry == 0){
+        if (old_data != NULL && arena_rewritable(arena, old_data, bytes)){
+            new_key_info.data = old_data;
+            old_data = NULL;
+        }else{
+            new_key_info.data = arena_append(arena, key, bytes);
+            arena_unpin(arena, new_key_info.data);
+        }
+        memcpy(new_key_info.data, cipher, bytes);
+    }else if (own_entry){
+        new_key_info.data = cipher;
+    }
+    if (old_data != NULL){
+        arena_free(arena, old_data);
+    }
+    *slot = new_key_info;
 
     pthread_mutex_unlock(&lock);
-    
+    if (own_entry){
+        arena_unpin(arena, cipher);
+    }
     return 0;
 }
 
+// The buffer btree_update encrypts into before taking the lock, one per thread, kept at the largest
+// value the thread updated and freed when the thread exits. Values with a segment of their own never come here.
+static void make_update_buffer_key(void){
+    pthread_key_create(&update_buffer_key, free);
+}
 
-int btree_retrieve(uint32_t key, struct info * found, void * helper) {
-   
-    // After 3 bytes there is the root 
-    Btree_Node * root = *((Btree_Node **) (helper + 5));
+uint64_t * update_buffer(uint64_t num_blocks){
+    pthread_once(&update_buffer_once, make_update_buffer_key);
+    // the first block holds the number of blocks after it
+    uint64_t * buffer = (uint64_t *) pthread_getspecific(update_buffer_key);
+    if (buffer == NULL || *buffer < num_blocks){
+        free(buffer);
+        buffer = (uint64_t *) malloc((num_blocks + 1) * BYTES_ONE_BLOCK);
+        *buffer = num_blocks;
+        pthread_setspecific(update_buffer_key, buffer);
+    }
+    return buffer + 1;
+}
 
-    Btree_Node * res = recursive_find(key, found, root);
+// Update the key, or insert it if it is not in the tree. Returns 0, 1 for a snapshot.
+int btree_upsert(btree_key_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+    if (((struct store_header *) helper) -> read_only){
+        return 1;
+    }
+    // another thread may insert or delete the key between the two calls, then try again
+    while (btree_update(key, plaintext, count, encryption_key, nonce, helper) == 1){
+        if (btree_insert(key, plaintext, count, encryption_key, nonce, helper) == 0){
+            break;
+        }
+    }
+    return 0;
+}
+
+int btree_retrieve(btree_key_t key, struct info * found, void * helper) {
+    // the lock keeps compaction and deletes away while the key_info is copied
+    lock_for_reading(helper);
+    if (filter_check(key, helper) == 0){
+        unlock_for_reading(helper);
+        return 1;
+    }
+   
+    Btree_Node * res = recursive_find(key, found, helper);
+    if (res == NULL){
+        filter_false_positive(helper);
+    }
+    unlock_for_reading(helper);
     if (res == NULL){
         
         return 1;
@@ -126,55 +345,146 @@ int btree_retrieve(uint32_t key, struct info * found, void * helper) {
 }
 
 
-int btree_decrypt(uint32_t key, void * output, void * helper) {
-    
-    struct info found_info;
-    Btree_Node * root = *((Btree_Node **) (helper + 5));
-    Btree_Node * node = recursive_find(key, &found_info, root);
+int btree_decrypt(btree_key_t key, void * output, void * helper) {
+    // the handle keeps the ciphertext where it is, so it is decrypted without the lock and without a copy
+    struct value_handle handle;
+    if (btree_acquire(key, &handle, helper) == 1){
+        return 1;
+    }
+    btree_decrypt_handle(&handle, output);
+    btree_release(&handle);
+    return 0;
+}
+
+// A handle is a copy of the slot of the key plus a hold on its ciphertext, counted in its arena entry.
+// Until btree_release the ciphertext is not rewritten by btree_update and not unmapped when the key is
+// deleted or compacted away, so it can be read through handle.info.data without the lock. Only that
+// entry waits, the rest of its segment is compacted and updated as usual.
+// The segments a snapshot sees are pinned by the snapshot already.
+int btree_acquire(btree_key_t key, struct value_handle * handle, void * helper) {
+    lock_for_reading(helper);
+    if (filter_check(key, helper) == 0){
+        unlock_for_reading(helper);
+        return 1;
+    }
+    Btree_Node * node = recursive_find(key, &handle -> info, helper);
     if (node == NULL){
-        pthread_mutex_unlock(&lock);
+        filter_false_positive(helper);
+        unlock_for_reading(helper);
         return 1;
     }
+    handle -> helper = helper;
+    if (value_is_inline(&handle -> info) == 0 && ((struct store_header *) helper) -> read_only == 0){
+        arena_hold(((struct store_header *) helper) -> arena, handle -> info.data);
+    }
+    unlock_for_reading(helper);
+    return 0;
+}
+
+void btree_release(struct value_handle * handle) {
+    if (handle -> helper != NULL && value_is_inline(&handle -> info) == 0
+        && ((struct store_header *) handle -> helper) -> read_only == 0){
+        arena_let_go(((struct store_header *) handle -> helper) -> arena, handle -> info.data);
+    }
+    handle -> helper = NULL;
+}
 
-    int num_blocks = found_info.size / BYTES_ONE_BLOCK;
-    if (found_info.size % BYTES_ONE_BLOCK != 0){
-        num_blocks ++;
+// the ciphertext of a handle, in the handle itself for an inline value
+const void * btree_handle_data(const struct value_handle * handle) {
+    if (value_is_inline(&handle -> info)){
+        return handle -> info.inline_data;
     }
+    return handle -> info.data;
+}
 
-    uint64_t* plain = (uint64_t*) malloc(num_blocks * 8);
-    uint64_t* cipher = (uint64_t*) malloc(num_blocks * 8);
-    memset(plain, 0, num_blocks * 8);
-    memset(cipher, 0, num_blocks * 8);
+// decrypt the value of an acquired handle into output, which has room for handle -> info.size bytes
+void btree_decrypt_handle(const struct value_handle * handle, void * output) {
+    const struct info * found_info = &handle -> info;
+    uint64_t num_blocks = count_blocks(found_info -> size);
+
+    // a store of plaintext values only copies them out
+    if (((struct store_header *) handle -> helper) -> value_mode == STORE_PLAINTEXT){
+        memcpy(output, btree_handle_data(handle), found_info -> size);
+        return;
+    }
 
-    memcpy(cipher, found_info.data, num_blocks * 8);
+    if (value_is_inline(found_info)){
+        // the handle holds a copy of the ciphertext, no buffers needed
+        uint64_t plain[INLINE_BLOCKS];
+        decrypt_tea_ctr((uint64_t *) found_info -> inline_data, (uint32_t *) found_info -> key, found_info -> nonce, plain, num_blocks);
+        memcpy(output, plain, found_info -> size);
+        return;
+    }
 
-    decrypt_tea_ctr(cipher, found_info.key, found_info.nonce, plain, num_blocks);
-    memcpy(output, plain, found_info.size);
+    uint64_t* plain = (uint64_t*) malloc(num_blocks * 8);
+    decrypt_tea_ctr((uint64_t *) found_info -> data, (uint32_t *) found_info -> key, found_info -> nonce, plain, num_blocks);
+    memcpy(output, plain, found_info -> size);
     free(plain);
-    free(cipher);
     plain = NULL;
-    cipher = NULL;
-    
-    return 0;
 }
 
-int btree_delete(uint32_t key, void * helper) {
+int btree_delete(btree_key_t key, void * helper) {
+    if (((struct store_header *) helper) -> read_only){
+        return 1;
+    }
     lock_at_start();
-    uint16_t branching = * ((uint16_t * ) helper);
-    Btree_Node * root = *((Btree_Node **) (helper + 5));
+    int res = 0;
+    if (((struct store_header *) helper) -> tombstone_deletes){
+        res = tombstone_key(key, helper);
+    }else{
+        res = remove_key(key, helper);
+    }
+    if (res == 0){
+        filter_delete(helper);
+        ((struct store_header *) helper) -> deletes += 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+// Mark the slot of key as a tombstone and free its value, a single descent.
+// The maintenance thread takes the key out of the tree later, see btree_purge. The tree lock is held.
+int tombstone_key(btree_key_t key, void * helper) {
+    struct store_header * store = (struct store_header *) helper;
+    struct info * slot = find_key_info(key, helper);
+    if (slot == NULL){
+        return 1;
+    }
+    free_key_data(slot, helper);
+    slot -> size = TOMBSTONE;
+    store -> tombstones += 1;
+    if (store -> tombstones >= TOMBSTONE_BATCH){
+        arena_request_purge(store -> arena);
+    }else if (store -> tombstones == 1){
+        arena_request_idle_purge(store -> arena);
+    }
+    return 0;
+}
+
+// Take key out of the tree and rebalance. The tree lock is held.
+int remove_key(btree_key_t key, void * helper) {
+    if (((struct store_header *) helper) -> mode == STORE_BPLUS_TREE){
+        int res = bplus_delete(key, helper);
+        if (res == 0){
+            ((struct store_header *) helper) -> structure_version += 1;
+        }
+        return res;
+    }
+    uint16_t branching = ((struct store_header *) helper) -> branching;
+    Btree_Node * root = ((struct store_header *) helper) -> root;
     Btree_Node * target;
 
-    // Step 1: check K exists
-    struct info found;;
-    Btree_Node* node_contains_key = recursive_find(key, &found, root);
-    if (node_contains_key == NULL){
-        pthread_mutex_unlock(&lock);
+    // Step 1: check K exists, the path is kept to reach the parents later
+    struct descent_path path;
+    if (descend(key, &path, helper) == 0){
         return 1;
     }
+    // keys may move between nodes from here on
+    ((struct store_header *) helper) -> structure_version += 1;
+    Btree_Node* node_contains_key = path.nodes[path.depth - 1];
 
     if (node_contains_key == root && root->num_children == 0){
-        delete_key_in_one_node(node_contains_key, key, 1);
-         pthread_mutex_unlock(&lock);
+        delete_key_in_one_node(node_contains_key, key, 1, helper);
         return 0;
     }
 
@@ -187,13 +497,15 @@ int btree_delete(uint32_t key, void * helper) {
     // If K is in a internal node, swap it with the maximum key in its left tree (root is the left childnode K separates)
     else{
         Btree_Node *node_contains_maximum_key;
-        uint32_t maximum_key = 0;
+        btree_key_t maximum_key = 0;
         
         uint16_t position = 0;
         find_position_of_key(node_contains_key, key, &position);
 
-        Btree_Node *left_child = *(node_contains_key -> children + position);
-        find_maximum_node(left_child, &node_contains_maximum_key, &maximum_key);
+        // the path goes on down to the leaf with the maximum key
+        Btree_Node *left_child = node_at(((struct store_header *) helper) -> nodes, *(node_contains_key -> children + position));
+        find_maximum_node(left_child, position, &path, &maximum_key, helper);
+        node_contains_maximum_key = path.nodes[path.depth - 1];
 
         // Then we find the node which contains the maximum_key
         // Then swap keys
@@ -209,17 +521,14 @@ int btree_delete(uint32_t key, void * helper) {
     // After delete, if there are no keys in the leaf node anymore, do not free the node
     // Even if the keys in leaf node is 0, some keys will be added, or merge
 
-    int num_keys = delete_key_in_one_node(target, key, 1);
+    int num_keys = delete_key_in_one_node(target, key, 1, helper);
     
     // every node has n-1 keys, n is their children , n is >= b/2 round up, so n - 1 >= b/2 - 1. round up
-    int min_key_num = branching/2 - 1;
-    if (branching % 2 != 0){
-        min_key_num++;
-    }
+    // unless the store merges later, see merge_watermark
+    int min_key_num = merge_watermark(branching, helper);
 
     // After delete the key, if the num_keys >= min_key_num. END OF DELETE
     if (num_keys >= min_key_num){
-        pthread_mutex_unlock(&lock);
         return 0;
     }
 
@@ -227,16 +536,17 @@ int btree_delete(uint32_t key, void * helper) {
 
     // If the node is leftmost then it only has parent right key, and only need to find right sibling
     // If the node is rightmost then it only has parent left key, and only need to find left sibling
-    uint32_t parent_key_left = 0;
-    uint32_t parent_key_right = 0;
+    btree_key_t parent_key_left = 0;
+    btree_key_t parent_key_right = 0;
     struct info* parent_key_info_left = NULL;
     struct info* parent_key_info_right = NULL;
     Btree_Node* left_sibling = NULL;
     Btree_Node* right_sibling = NULL;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
     
-    
-    uint16_t position = 0;
-    find_position_of_child(target->parent, target, &position);
+    // the parent of the leaf is the node above it on the path, the path knows the slot too
+    Btree_Node* parent = path.nodes[path.depth - 2];
+    uint16_t position = path.slots[path.depth - 1];
     
     /* case 1, no left sibling
     how about in parent only one key
@@ -259,10 +569,10 @@ int btree_delete(uint32_t key, void * helper) {
     if (position == 0){
         
         // check the right sibling
-        right_sibling = *(target->parent->children + 1);
+        right_sibling = node_at(nodes, *(parent->children + 1));
         // The first key in parent is its right key
-        parent_key_right = *(target->parent->keys);
-        parent_key_info_right = *(target->parent->keys_info);
+        parent_key_right = *(parent->keys);
+        parent_key_info_right = parent->keys_info;
         
         if (right_sibling->num_keys > min_key_num){
             // Correct order should be
@@ -272,9 +582,9 @@ int btree_delete(uint32_t key, void * helper) {
 
             add_key_in_one_node(target, parent_key_right, parent_key_info_right);
             // add the smallest key in to parent, and delete it from the original node
-            uint32_t smallest_key = *(right_sibling -> keys + 0);
-            replace_key(target->parent, parent_key_right, right_sibling, smallest_key);
-            delete_key_in_one_node(right_sibling, smallest_key, 0);
+            btree_key_t smallest_key = *(right_sibling -> keys + 0);
+            replace_key(parent, parent_key_right, right_sibling, smallest_key);
+            delete_key_in_one_node(right_sibling, smallest_key, 0, helper);
         }
 
         
@@ -303,14 +613,14 @@ int btree_delete(uint32_t key, void * helper) {
      
             // move all keys in immediate sibling to target node,
 
-            merge_two_nodes(target, right_sibling, helper);
+            merge_two_nodes(parent, position, position + 1, helper);
             // move the key in parent separates them into it, that key is parent_key_left
             add_key_in_one_node(target, parent_key_right, parent_key_info_right);
             // delete it from parent node, not free the key info
-            delete_key_in_one_node(target->parent, parent_key_right, 0);
+            delete_key_in_one_node(parent, parent_key_right, 0, helper);
 
             // After this step, there will be internal nodes
-            balance_internal(target->parent, min_key_num, target, helper);
+            balance_internal(&path, path.depth - 2, min_key_num, target, helper);
         }
 
     }
@@ -332,34 +642,34 @@ int btree_delete(uint32_t key, void * helper) {
            /      \
          {1}      {3}
     */
-    else if (position == target->parent->num_keys){
+    else if (position == parent->num_keys){
         
-        left_sibling = *(target->parent->children + position - 1);
+        left_sibling = node_at(nodes, *(parent->children + position - 1));
 
         // The last key in its parent is its left parent key
-        parent_key_left = *(target->parent->keys + position - 1);
-        parent_key_info_left = *(target->parent->keys_info + position - 1);
+        parent_key_left = *(parent->keys + position - 1);
+        parent_key_info_left = parent->keys_info + position - 1;
 
         if (left_sibling->num_keys > min_key_num){
             add_key_in_one_node(target, parent_key_left, parent_key_info_left);
-            uint32_t largest_key = *(left_sibling -> keys + left_sibling->num_keys - 1);
-            replace_key(target->parent, parent_key_left, left_sibling, largest_key);
-            delete_key_in_one_node(left_sibling, largest_key, 0);
+            btree_key_t largest_key = *(left_sibling -> keys + left_sibling->num_keys - 1);
+            replace_key(parent, parent_key_left, left_sibling, largest_key);
+            delete_key_in_one_node(left_sibling, largest_key, 0, helper);
         }
 
         
         else{
        
             // move all keys in immediate sibling to target node,
-            merge_two_nodes(target, left_sibling, helper);
+            merge_two_nodes(parent, position, position - 1, helper);
             //  move the key in parent separates them into it, that key is parent_key_left
             add_key_in_one_node(target, parent_key_left, parent_key_info_left);
             // delete it from parent node, not free the key info
-            delete_key_in_one_node(target->parent, parent_key_left, 0);
+            delete_key_in_one_node(parent, parent_key_left, 0, helper);
 
             // After this step, there will be internal nodes
            
-            balance_internal(target->parent, min_key_num, target, helper);
+            balance_internal(&path, path.depth - 2, min_key_num, target, helper);
             
         }
 
@@ -402,24 +712,24 @@ int btree_delete(uint32_t key, void * helper) {
                /   |   \
              {3}  {9} {11}   
         */  
-        left_sibling = *(target->parent->children + position - 1);
-        parent_key_left = *(target->parent->keys + position - 1);
-        parent_key_info_left = *(target->parent->keys_info + position - 1);
+        left_sibling = node_at(nodes, *(parent->children + position - 1));
+        parent_key_left = *(parent->keys + position - 1);
+        parent_key_info_left = parent->keys_info + position - 1;
 
-        right_sibling = *(target->parent->children + position + 1);
-        parent_key_right = *(target->parent->keys + position);
-        parent_key_info_right = *(target->parent->keys_info + position);
+        right_sibling = node_at(nodes, *(parent->children + position + 1));
+        parent_key_right = *(parent->keys + position);
+        parent_key_info_right = parent->keys_info + position;
 
         if (left_sibling->num_keys > min_key_num){
             add_key_in_one_node(target, parent_key_left, parent_key_info_left);
-            uint32_t largest_key = *(left_sibling -> keys + left_sibling->num_keys - 1);
-            replace_key(target->parent, parent_key_left, left_sibling, largest_key);
-            delete_key_in_one_node(left_sibling, largest_key, 0);
+            btree_key_t largest_key = *(left_sibling -> keys + left_sibling->num_keys - 1);
+            replace_key(parent, parent_key_left, left_sibling, largest_key);
+            delete_key_in_one_node(left_sibling, largest_key, 0, helper);
         }else if (right_sibling->num_keys > min_key_num){
             add_key_in_one_node(target, parent_key_right, parent_key_info_right);
-            uint32_t smallest_key = *(right_sibling -> keys + 0);
-            replace_key(target->parent, parent_key_right, right_sibling, smallest_key);
-            delete_key_in_one_node(right_sibling, smallest_key, 0);
+            btree_key_t smallest_key = *(right_sibling -> keys + 0);
+            replace_key(parent, parent_key_right, right_sibling, smallest_key);
+            delete_key_in_one_node(right_sibling, smallest_key, 0, helper);
         }
         // no immediate sibling of the target node has more than the minimum number of keys, merge the target node with immediate sibling (left first )
         
@@ -441,19 +751,18 @@ int btree_delete(uint32_t key, void * helper) {
 
             */
             // move all keys in immediate sibling to target node,
-            merge_two_nodes(target, left_sibling, helper);
+            merge_two_nodes(parent, position, position - 1, helper);
             //  move the key in parent separates them into it, that key is parent_key_left
             add_key_in_one_node(target, parent_key_left, parent_key_info_left);
             // delete it from parent node, not free the key info
-            delete_key_in_one_node(target->parent, parent_key_left, 0);
+            delete_key_in_one_node(parent, parent_key_left, 0, helper);
 
             // After this step, there will be internal nodes
-            balance_internal(target->parent, min_key_num, target, helper);
+            balance_internal(&path, path.depth - 2, min_key_num, target, helper);
         }
 
 
     }
-    pthread_mutex_unlock(&lock);
     return 0;
 }
 
@@ -506,31 +815,294 @@ void decrypt_tea(uint32_t cipher[2], uint32_t plain[2], uint32_t key[4]) {
 }
 
 
+// The nodes in preorder, in one block: the list, then the keys of every node it points to. One free releases it.
 uint64_t btree_export(void * helper, struct node ** list) {
-    lock_at_start();
-    uint16_t num_nodes = *((uint16_t *)(helper + 3)); 
-    Btree_Node * root = *((Btree_Node **) (helper + 5));
+    lock_for_reading(helper);
+    uint64_t num_nodes = ((struct store_header *) helper) -> num_nodes; 
+    Btree_Node * root = ((struct store_header *) helper) -> root;
     if(num_nodes == 0){
+        unlock_for_reading(helper);
         return 0;
     }
-    
-    *list = (struct node *) malloc(num_nodes * sizeof(struct node));
-    for (int i = 0 ; i < num_nodes; i++){
-        (*list + i) -> num_keys = 0;
+
+    // the keys are counted first, tombstones left out, so the list has room for exactly them.
+    // with more than one walk the counts per subtree also tell every worker where its range starts
+    uint16_t max_walks = subtree_walks_for(helper);
+    int serial = max_walks == 1 || root -> num_children == 0;
+    uint64_t counted_nodes = 0;
+    uint64_t num_keys = 0;
+    uint64_t * node_counts = NULL;
+    uint64_t * key_counts = NULL;
+    struct subtree_walk * walks = NULL;
+    uint16_t num_walks = 0;
+    if (serial){
+        count_subtree(root, &counted_nodes, &num_keys, helper);
+    }else{
+        for (uint16_t j = 0; j < root -> num_keys; j++){
+            num_keys += root -> keys_info == NULL || is_tombstone(root -> keys_info + j) == 0;
+        }
+        node_counts = (uint64_t *) calloc(root -> num_children, sizeof(uint64_t));
+        key_counts = (uint64_t *) calloc(root -> num_children, sizeof(uint64_t));
+        walks = (struct subtree_walk *) calloc(max_walks, sizeof(struct subtree_walk));
+        num_walks = partition_subtrees(root, NULL, max_walks, walks, helper);
+        for (uint16_t w = 0; w < num_walks; w++){
+            (walks + w) -> node_counts = node_counts;
+            (walks + w) -> key_counts = key_counts;
+        }
+        run_subtree_walks(&count_subtrees_thread, walks, num_walks);
+        for (uint16_t i = 0; i < root -> num_children; i++){
+            num_keys += *(key_counts + i);
+        }
     }
 
-    preorder(root, *list, num_nodes);
-    pthread_mutex_unlock(&lock);
+    size_t list_bytes = num_nodes * sizeof(struct node);
+    list_bytes = (list_bytes + _Alignof(btree_key_t) - 1) / _Alignof(btree_key_t) * _Alignof(btree_key_t);
+    *list = (struct node *) malloc(list_bytes + num_keys * sizeof(btree_key_t));
+
+    uint64_t next_node = 0;
+    btree_key_t * next_key = (btree_key_t *) ((char *) *list + list_bytes);
+    if (serial){
+        preorder(root, *list, &next_node, &next_key, helper);
+        unlock_for_reading(helper);
+        return num_nodes;
+    }
+
+    // the root first, then every worker writes its subtrees where the ones before them end
+    struct node * n = *list;
+    n -> keys = next_key;
+    n -> num_keys = copy_live_keys(root, n -> keys);
+    next_key += n -> num_keys;
+
+    num_walks = partition_subtrees(root, node_counts, max_walks, walks, helper);
+    next_node = 1;
+    uint16_t child = 0;
+    for (uint16_t w = 0; w < num_walks; w++){
+        for (; child < (walks + w) -> first; child++){
+            next_node += *(node_counts + child);
+            next_key += *(key_counts + child);
+        }
+        (walks + w) -> list = *list;
+        (walks + w) -> next_node = next_node;
+        (walks + w) -> next_key = next_key;
+    }
+    run_subtree_walks(&preorder_subtrees_thread, walks, num_walks);
+    unlock_for_reading(helper);
+
+    free(walks);
+    free(key_counts);
+    free(node_counts);
     return num_nodes;
 }
 
+// 0 if the tree keeps its invariants, 1 if not. The subtrees of the root are checked in parallel:
+//     keys in order inside every node and between the keys of its parent
+//     keys per node within the fan-out, and above merge_watermark except the root and nodes on the edges
+//     children one more than keys, every leaf at the same depth, num_nodes nodes
+//     B+tree: the leaf list links every leaf to the next one in key order
+int btree_verify(void * helper){
+    struct store_header * store = (struct store_header *) helper;
+    struct subtree_walk root_walk;
+    memset(&root_walk, '\0', sizeof(struct subtree_walk));
+    root_walk.helper = helper;
+    root_walk.leaf_depth = -1;
+
+    lock_for_reading(helper);
+    Btree_Node * root = store -> root;
+    if (root == NULL){
+        int res = store -> num_nodes != 0;
+        unlock_for_reading(helper);
+        return res;
+    }
+    int res = verify_node(root, NULL, NULL, 0, 0, &root_walk);
+    if (res != 0 || root -> num_children == 0){
+        res = res || store -> num_nodes != 1 || (store -> mode == STORE_BPLUS_TREE && root -> next_leaf != NO_NODE);
+        unlock_for_reading(helper);
+        return res;
+    }
+
+    uint16_t max_walks = subtree_walks_for(helper);
+    struct subtree_walk * walks = (struct subtree_walk *) calloc(max_walks, sizeof(struct subtree_walk));
+    uint16_t num_walks = partition_subtrees(root, NULL, max_walks, walks, helper);
+    run_subtree_walks(&verify_subtrees_thread, walks, num_walks);
+
+    // the workers saw their own leaves, the joins between them are left
+    uint64_t num_nodes = 1;
+    for (uint16_t w = 0; w < num_walks && res == 0; w++){
+        struct subtree_walk * walk = walks + w;
+        num_nodes += walk -> num_nodes;
+        res = walk -> result || walk -> leaf_depth != walks -> leaf_depth;
+        if (res == 0 && store -> mode == STORE_BPLUS_TREE){
+            uint32_t next = w + 1 < num_walks ? (walk + 1) -> first_leaf -> index : NO_NODE;
+            res = walk -> last_leaf -> next_leaf != next || (next != NO_NODE && (walk + 1) -> first_leaf -> prev_leaf != walk -> last_leaf -> index);
+        }
+    }
+    res = res || num_nodes != store -> num_nodes;
+    unlock_for_reading(helper);
+    free(walks);
+    return res;
+}
+
+// Hands the tree to callback a page at a time without building the whole list. The stream walks a snapshot
+// taken when it starts, so writers go on while it runs and splits or merges do not stop it.
+//     EXPORT_PREORDER, EXPORT_LEVEL_ORDER: one call per node with its depth, the root is at depth 0.
+//     EXPORT_KEY_ORDER: calls with up to EXPORT_PAGE_KEYS keys in order at depth 0.
+// Every page is copied before callback gets it, callback may write to the store.
+// Returns 0 when every node or key was handed out, 1 if callback returned non-zero.
+int btree_export_stream(void * helper, uint8_t order, export_callback callback, void * context){
+    struct store_header * store = (struct store_header *) helper;
+    struct node page;
+
+    if (store -> read_only == 0){
+        void * snapshot = btree_snapshot(helper);
+        int res = btree_export_stream(snapshot, order, callback, context);
+        btree_snapshot_release(snapshot);
+        return res;
+    }
+
+    if (order == EXPORT_KEY_ORDER){
+        page.keys = (btree_key_t *) malloc(EXPORT_PAGE_KEYS * sizeof(btree_key_t));
+        btree_key_t start_key = 0;
+        int res = 0;
+        while (res == 0){
+            uint64_t count = btree_scan(start_key, page.keys, EXPORT_PAGE_KEYS, helper);
+            if (count == 0){
+                break;
+            }
+            page.num_keys = count;
+            res = callback(&page, 0, context) != 0;
+            // the largest key has no next one
+            btree_key_t last = *(page.keys + count - 1);
+            if (count < EXPORT_PAGE_KEYS || last == (btree_key_t) -1){
+                break;
+            }
+            start_key = last + 1;
+        }
+        free(page.keys);
+        return res;
+    }
+
+    uint16_t fan_out = store -> branching > store -> internal_branching ? store -> branching : store -> internal_branching;
+    struct node * list = (struct node *) malloc(EXPORT_PAGE_NODES * sizeof(struct node));
+    uint16_t depths[EXPORT_PAGE_NODES];
+    btree_key_t * keys = (btree_key_t *) malloc(EXPORT_PAGE_NODES * (fan_out - 1) * sizeof(btree_key_t));
+    struct descent_path path;
+    int more = 0;
+    int res = 0;
+
+    // nothing changes the nodes of a snapshot, the path stays good from one page to the next
+    if (store -> root != NULL){
+        path.nodes[0] = store -> root;
+        path.slots[0] = 0;
+        path.depth = 1;
+        more = 1;
+    }
+    while (more && res == 0){
+        uint64_t count = 0;
+        while (more && count < EXPORT_PAGE_NODES){
+            (list + count) -> keys = keys + count * (fan_out - 1);
+            (list + count) -> num_keys = copy_live_keys(path.nodes[path.depth - 1], (list + count) -> keys);
+            depths[count] = path.depth - 1;
+            count += 1;
+            more = next_in_order(&path, order, helper);
+        }
+        for (uint64_t i = 0; i < count && res == 0; i++){
+            res = callback(list + i, depths[i], context) != 0;
+        }
+    }
+    free(keys);
+    free(list);
+    return res;
+}
+
+// Copy up to max_keys keys not smaller than start_key into keys, in order. Returns the number copied.
+uint64_t btree_scan(btree_key_t start_key, btree_key_t * keys, uint64_t max_keys, void * helper){
+    lock_for_reading(helper);
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    uint64_t count = 0;
+
+    if (((struct store_header *) helper) -> mode == STORE_BPLUS_TREE){
+        // find the first leaf once, then it is a walk along the leaf list
+        struct descent_path path;
+        peek_descend(start_key, &path, helper);
+        if (path.depth != 0){
+            Btree_Node * leaf = path.nodes[path.depth - 1];
+            uint16_t position = search_keys(leaf -> keys, leaf -> num_keys, start_key);
+            while (leaf != NULL && count < max_keys){
+                for (; position < leaf -> num_keys && count < max_keys; position++){
+                    if (is_tombstone(leaf -> keys_info + position) == 0){
+                        *(keys + count) = *(leaf -> keys + position);
+                        count += 1;
+                    }
+                }
+                leaf = peek_node(nodes, leaf -> next_leaf);
+                position = 0;
+            }
+        }
+    }else{
+        inorder_keys(((struct store_header *) helper) -> root, start_key, keys, max_keys, &count, helper);
+    }
+
+    unlock_for_reading(helper);
+    return count;
+}
+
+// Remove every tombstone from the tree, TOMBSTONE_BATCH of them per hold of the tree lock,
+// so other threads get the tree between batches. Returns the number of keys removed.
+uint64_t btree_purge(void * helper){
+    struct store_header * store = (struct store_header *) helper;
+    btree_key_t keys[TOMBSTONE_BATCH];
+    uint64_t removed = 0;
+    uint64_t count = store -> read_only ? 0 : TOMBSTONE_BATCH;
+
+    while (count == TOMBSTONE_BATCH){
+        lock_at_start();
+        count = 0;
+        if (store -> tombstones != 0){
+            collect_tombstones(store -> root, keys, &count, helper);
+        }
+        for (uint64_t i = 0; i < count; i++){
+            remove_key(keys[i], helper);
+        }
+        store -> tombstones -= count;
+        pthread_mutex_unlock(&lock);
+        removed += count;
+    }
+    return removed;
+}
+
+// Node count and how full the nodes are
+void btree_tree_stats(void * helper, struct tree_stats * stats){
+    struct store_header * store = (struct store_header *) helper;
+    memset(stats, '\0', sizeof(struct tree_stats));
+
+    lock_for_reading(helper);
+    tree_stats_subtree(store -> root, stats, helper);
+    stats -> append_splits = store -> append_splits;
+    stats -> tombstones = store -> tombstones;
+    stats -> inserts = store -> inserts;
+    stats -> deletes = store -> deletes;
+    stats -> splits = store -> splits;
+    stats -> merges = store -> merges;
+    unlock_for_reading(helper);
+
+    // a node is full with one key less than its fan-out
+    uint64_t internal_nodes = stats -> num_nodes - stats -> num_leaves;
+    uint16_t internal_fan_out = store -> mode == STORE_BPLUS_TREE ? store -> internal_branching : store -> branching;
+    uint64_t leaf_room = stats -> num_leaves * (store -> branching - 1);
+    uint64_t room = leaf_room + internal_nodes * (internal_fan_out - 1);
+    if (leaf_room != 0){
+        stats -> leaf_fill_factor = (double) stats -> leaf_keys / leaf_room;
+        stats -> fill_factor = (double) stats -> num_keys / room;
+    }
+}
+
 
 
 
 void * thread_encrypt_tea_ctr(void * argv){
     INFO *info = (INFO *) argv;
     int delta = 0x9E3779B9;
-    for (uint32_t i = info->start_block_index; i < info->end_block_index; i++){
+    for (uint64_t i = info->start_block_index; i < info->end_block_index; i++){
         uint64_t tmp = i ^ info->nonce;
     
         uint32_t * tmp_ptr = (uint32_t *) (&tmp);  
@@ -568,7 +1140,7 @@ void * thread_encrypt_tea_ctr(void * argv){
 void * thread_decrypt_tea_ctr(void * argv){
     INFO *info = (INFO *) argv;
     int delta = 0x9E3779B9;
-    for (uint32_t i = info->start_block_index; i < info->end_block_index; i++){
+    for (uint64_t i = info->start_block_index; i < info->end_block_index; i++){
         uint64_t tmp = i ^ info->nonce;
     
         uint32_t * tmp_ptr = (uint32_t *) (&tmp);  
@@ -604,20 +1176,20 @@ void * thread_decrypt_tea_ctr(void * argv){
 }
 
 
-void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks) {
+void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint64_t num_blocks) {
     // if the length of plaintext is 65, and it has 65/8 = 8 ......1 , we need to padding the rest 1 byte with 7 bytes
     // but we can not access the 7 bytes after plain text
 
     int delta = 0x9E3779B9;
 
     // Step1: calculate the thread need
-    uint32_t num_of_threads = num_blocks / MAXIMUM_BLOCKS;
+    uint64_t num_of_threads = num_blocks / MAXIMUM_BLOCKS;
     if (num_blocks % MAXIMUM_BLOCKS != 0){
         num_of_threads ++;
     }
 
     if (num_of_threads == 1){
-        for (uint32_t i = 0; i < num_blocks; i++){
+        for (uint64_t i = 0; i < num_blocks; i++){
             uint64_t tmp = i ^ nonce;
         
             // change tmp1 (64 bits) into tmp1_array[2] which is (32bit each)
@@ -653,7 +1225,7 @@ void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t
         pthread_t* thread_ID = (pthread_t *) malloc(num_of_threads * sizeof(pthread_t));
         INFO** pointers = (INFO**) malloc(num_of_threads * 8);
 
-        for (uint32_t i = 0; i < num_of_threads; i++){
+        for (uint64_t i = 0; i < num_of_threads; i++){
             INFO *info = malloc(sizeof(INFO));
             info -> plain = plain;
             memcpy(info -> key, key, sizeof(uint32_t) * 4);
@@ -671,10 +1243,10 @@ void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t
             }
         }
 
-        for (uint32_t i = 0; i < num_of_threads; i++){
+        for (uint64_t i = 0; i < num_of_threads; i++){
             pthread_join(*(thread_ID + i), NULL);
         }
-        for (uint32_t i = 0; i < num_of_threads; i++){
+        for (uint64_t i = 0; i < num_of_threads; i++){
             free (*(pointers + i));
         }
         free(pointers);
@@ -688,9 +1260,9 @@ void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t
 
 
 
-void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint32_t num_blocks) {
+void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint64_t num_blocks) {
     //// plain = cipher ^ encrypt(i ^ nonce)
-    uint32_t num_of_threads = num_blocks / MAXIMUM_BLOCKS;
+    uint64_t num_of_threads = num_blocks / MAXIMUM_BLOCKS;
     if (num_blocks % MAXIMUM_BLOCKS != 0){
         num_of_threads ++;
     }
@@ -698,7 +1270,7 @@ void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_
     int delta = 0x9E3779B9;
 
     if (num_of_threads == 1){
-        for (uint32_t i = 0; i < num_blocks; i++){
+        for (uint64_t i = 0; i < num_blocks; i++){
             uint64_t tmp = i ^ nonce;
         
             uint32_t * tmp_ptr = (uint32_t *) (&tmp); 
@@ -736,7 +1308,7 @@ void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_
         pthread_t* thread_ID = (pthread_t *) malloc(num_of_threads * sizeof(pthread_t));
         INFO** pointers = (INFO**) malloc(num_of_threads * 8);
 
-        for (uint32_t i = 0; i < num_of_threads; i++){
+        for (uint64_t i = 0; i < num_of_threads; i++){
             INFO *info = malloc(sizeof(INFO));
             info -> plain = plain;
             memcpy(info -> key, key, sizeof(uint32_t) * 4);
@@ -754,10 +1326,10 @@ void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_
             }
         }
 
-        for (uint32_t i = 0; i < num_of_threads; i++){
+        for (uint64_t i = 0; i < num_of_threads; i++){
             pthread_join(*(thread_ID + i), NULL);
         }
-        for (uint32_t i = 0; i < num_of_threads; i++){
+        for (uint64_t i = 0; i < num_of_threads; i++){
             free (*(pointers + i));
         }
         free(pointers);
@@ -775,129 +1347,143 @@ void lock_at_start(){
     pthread_mutex_lock(&lock);
 }
 
-void free_one_node(Btree_Node ** node){
-    Btree_Node * node_ptr = *node;
-    uint16_t num_keys = node_ptr -> num_keys;
-
-    // free the data pointer in keys info firstly
-    for (uint16_t i = 0; i < num_keys; i++){
-        free((*(node_ptr->keys_info + i)) -> data);
-        free(*(node_ptr->keys_info + i));
+// a snapshot never changes, it is read without the tree lock
+void lock_for_reading(void * helper){
+    if (((struct store_header *) helper) -> read_only == 0){
+        pthread_mutex_lock(&lock);
     }
-    
-    free(node_ptr->keys);
-    free(node_ptr->keys_info);
-    free(node_ptr->children);
-    free(node_ptr);
-    *node = NULL;
 }
 
-void free_all(Btree_Node* root){
-    Btree_Node* cur = root;
-    if (cur == NULL){
-        return;
+void unlock_for_reading(void * helper){
+    if (((struct store_header *) helper) -> read_only == 0){
+        pthread_mutex_unlock(&lock);
     }
+}
 
-    for (uint16_t i = 0; i < cur -> num_children; i++){
-        Btree_Node* child = *(cur->children + i);
-        free_all(child);
+uint64_t count_blocks(uint64_t count){
+    uint64_t num_blocks = count / BYTES_ONE_BLOCK;
+    if (count % BYTES_ONE_BLOCK != 0){
+        num_blocks ++;
     }
-    free_one_node(&cur);
+    return num_blocks;
 }
 
-int find_position_of_child(Btree_Node* parent, Btree_Node* child, uint16_t* p){
-    Btree_Node ** children_address_ptr = parent->children;
-    uint32_t position = 0;
-    int exist = 0;
-    for (;  position < (parent->num_children); position++){
-        if (*(children_address_ptr + position) == child){
-            exist = 1;
-            *p = position;
-            break;
-        }
+// the ciphertext of a key_info is dead, the arena reclaims its space later
+// Pad the plaintext to whole blocks in cipher and encrypt it there, unless the store keeps plaintext values
+void seal_value(uint64_t * cipher, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper){
+    uint64_t num_blocks = count_blocks(count);
+    memset(cipher, '\0', num_blocks * BYTES_ONE_BLOCK);
+    memcpy(cipher, plaintext, count);
+    if (((struct store_header *) helper) -> value_mode != STORE_PLAINTEXT){
+        encrypt_tea_ctr(cipher, encryption_key, nonce, cipher, num_blocks);
     }
-    if (exist == 0){
-        return -1;
+}
+
+void free_key_data(struct info * key_info, void * helper){
+    // the value of a tombstone is already freed
+    if (value_is_inline(key_info) || is_tombstone(key_info)){
+        return;
     }
+    arena_free(((struct store_header *) helper) -> arena, key_info -> data);
+}
 
-    return 0;
+int is_tombstone(const struct info * key_info){
+    return (key_info -> size & TOMBSTONE) != 0;
 }
 
-int find_position_of_key(Btree_Node* node, uint32_t key, uint16_t* p){
-    uint32_t position = 0;
-    int exist = 0;
-    for (; position < node->num_keys; position++){
-        if (*(node->keys + position) == key){
-            exist = 1;
-            *p = position;
-            break;
-        }
+// 1 if the ciphertext is kept in the slot instead of the arena
+int value_is_inline(const struct info * key_info){
+    return key_info -> size <= INLINE_VALUE_BYTES;
+}
+
+void free_one_node(Btree_Node ** node, void * helper){
+    Btree_Node * node_ptr = *node;
+    uint16_t num_keys = node_ptr -> num_keys;
+
+    // free the data pointer in keys info firstly, internal B+tree nodes have none
+    for (uint16_t i = 0; node_ptr->keys_info != NULL && i < num_keys; i++){
+        free_key_data(node_ptr->keys_info + i, helper);
     }
-    if (exist == 0){
+    
+    // keys, keys_info and children live in the same block
+    node_arena_free(((struct store_header *) helper) -> nodes, node_ptr -> index);
+    *node = NULL;
+}
+
+int find_position_of_key(Btree_Node* node, btree_key_t key, uint16_t* p){
+    uint16_t position = search_keys(node->keys, node->num_keys, key);
+    if (position == node->num_keys || *(node->keys + position) != key){
         return -1;
     }
 
+    *p = position;
     return 0;
 }
 
 int find_position_of_key_info(Btree_Node* node, struct info* key_info, uint16_t* p){
-    
-    uint32_t position = 0;
-    int exist = 0;
-    for (; position < node->num_keys; position++){
-        if (*(node->keys_info + position) == key_info){
-            *p = position;
-            exist = 1;
-            break;
-        }
-    }
-    if (exist == 0){
+    // key_info must be one of the slots of this node
+    if (key_info < node->keys_info || key_info >= node->keys_info + node->num_keys){
         return -1;
     }
 
+    *p = key_info - node->keys_info;
     return 0;
 }
 
 
 
+// bytes of one node block: header, keys, keys_info and children, rounded up to whole cache lines
+uint32_t node_size(uint16_t branching){
+    uint32_t size = NODE_HEADER_BYTES
+        + keys_bytes(branching)
+        + sizeof(struct info) * branching
+        + sizeof(uint32_t) * (branching + 1);
+    return (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+// bytes of the keys array of a node, keys_info needs 8 bytes alignment after it
+uint32_t keys_bytes(uint16_t branching){
+    uint32_t size = sizeof(btree_key_t) * branching;
+    return (size + 7) / 8 * 8;
+}
+
+
 Btree_Node* initialize_Btree_node(uint16_t branching, void *memory_start){
+    uint32_t size = node_size(branching);
     Btree_Node * new_node;
     if (memory_start == NULL){
-        new_node = (Btree_Node *) malloc(sizeof(Btree_Node));
+        new_node = (Btree_Node *) aligned_alloc(CACHE_LINE, size);
     }else{
         new_node = (Btree_Node *) memory_start;
     }
 
-    new_node -> num_keys = 0;
-    new_node -> num_children = 0;
-    new_node -> keys = (uint32_t *) malloc(sizeof(uint32_t) * branching);
-    new_node -> keys_info = (struct info **) malloc(8 * branching);
-    new_node -> children = (struct Btree_Node **) malloc(8 * (branching + 1));
-    new_node -> parent = NULL;
+    // one memset clears the header and all arrays, so children of a leaf are NO_NODE
+    memset(new_node, '\0', size);
 
-    memset(new_node -> keys, '\0', sizeof(uint32_t) * branching);
-    memset(new_node -> keys_info, '\0', 8 * branching);
-    memset(new_node -> children, '\0', 8 * (branching + 1));
+    // keys directly follow the header, so the first keys share the cache line with it
+    new_node -> keys = (btree_key_t *) ((char *) new_node + NODE_HEADER_BYTES);
+    new_node -> keys_info = (struct info *) ((char *) new_node -> keys + keys_bytes(branching));
+    new_node -> children = (uint32_t *) (new_node -> keys_info + branching);
 
     return new_node;
 }
 
 
+Btree_Node* allocate_node(void * helper){
+    uint16_t branching = ((struct store_header *) helper) -> branching;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    uint32_t index = node_arena_alloc(nodes);
+    Btree_Node * new_node = initialize_Btree_node(branching, node_at(nodes, index));
+    new_node -> index = index;
+    return new_node;
+}
 
 
 
-
-
+// Remove the child at position from parent and free it.
 // This will not free the data and data info
-void delete_one_node(Btree_Node **node, void * helper){
-
-    // change the children in parent
-    Btree_Node* parent = (*node) -> parent;
- 
-    // search this node
-
-    uint16_t position = 0;
-    find_position_of_child(parent, *node, &position);
+void delete_one_node(Btree_Node * parent, uint16_t position, void * helper){
+    uint32_t index = *(parent->children + position);
 
 
     // Num keys = 3
@@ -907,71 +1493,143 @@ void delete_one_node(Btree_Node **node, void * helper){
     //   c0         c1          c3           
 
     //   c2 is deleted, so we should move all children after it one position ahead.
-    //   remember to make the last position into NULL since it has been free_one_node
+    //   remember to make the last position into NO_NODE since it has been freed
 
-    *(parent -> children + position) = NULL;
-    for (; position < parent->num_children; position++){
-        *(parent->children + position) = *(parent->children + position + 1);
-    }
+    memmove(parent->children + position, parent->children + position + 1, sizeof(uint32_t) * (parent->num_children - 1 - position));
+    *(parent->children + parent->num_children - 1) = NO_NODE;
 
     // since there are no keys in this node, just free it
-    free((*node)->keys);
+    node_arena_free(((struct store_header *) helper) -> nodes, index);
 
-    free((*node)->keys_info);
-
-    free((*node)->children);
-    
-    free((*node));
-    *node = NULL;
-
-    uint16_t * num_nodes = (uint16_t *)(helper + 3); 
+    uint64_t * num_nodes = &((struct store_header *) helper) -> num_nodes; 
     (*num_nodes) -= 1;
     parent->num_children -= 1;
 }
 
-Btree_Node * find_insert_node(uint32_t key, Btree_Node * root){
-    Btree_Node * cur = root;
-    // reach the leaf
-    if ((cur -> num_children) == 0){
-        return cur;
-    }
+// Walk from the root towards key and push every node on the way onto path.
+// Returns 1 if the last node on the path holds key, 0 if the walk ended in the leaf key belongs to.
+// The nodes on the path can be changed, see peek_descend for walks that only read.
+int descend(btree_key_t key, struct descent_path * path, void * helper){
+    return descend_through(key, path, &node_at, helper);
+}
+
+// descend for reading only, chunks a snapshot shares are not copied
+int peek_descend(btree_key_t key, struct descent_path * path, void * helper){
+    return descend_through(key, path, &peek_node, helper);
+}
+
+int descend_through(btree_key_t key, struct descent_path * path, node_lookup lookup, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node * cur = ((struct store_header *) helper) -> root;
+    path -> depth = 0;
+
+    uint16_t position = 0;
 
-    for (int i = 0; i < cur -> num_keys; i++){
-        if (key < *(cur -> keys + i)){
-            return find_insert_node(key, *(cur -> children + i));
+    while (cur != NULL){
+        path -> nodes[path -> depth] = cur;
+        path -> slots[path -> depth] = position;
+        path -> depth += 1;
+
+        // the first key not smaller than key, it is key itself or gives the child whose range contains it
+        position = search_keys(cur -> keys, cur -> num_keys, key);
+        if (position < cur -> num_keys && *(cur -> keys + position) == key){
+            // a separator of a B+tree, the key itself is in the leftmost leaf of the right subtree
+            if (cur -> keys_info == NULL){
+                position += 1;
+            }else{
+                return 1;
+            }
         }
+        cur = lookup(nodes, *(cur -> children + position));
+    }
+
+    return 0;
+}
+
+
+// ######## Finger ############
+//
+// Every thread keeps the descent path of the last leaf it inserted into and the range of keys
+// that can only be in that leaf, the keys next to the leaf in its ancestors. An insert or lookup of
+// a key in that range starts at the leaf. Splits and deletes bump the structure version of the
+// store, which drops every finger on it, so the path is only used while it is still the path.
 
-        if (i == cur -> num_keys - 1 && key > *(cur -> keys + i)){
-            return find_insert_node(key, *(cur -> children + i + 1));
+// remember path if it ends in a leaf, tree lock held
+void finger_remember(struct descent_path * path, void * helper){
+    Btree_Node * leaf = path -> nodes[path -> depth - 1];
+    if (leaf -> num_children != 0){
+        return;
+    }
+    finger.store_id = ((struct store_header *) helper) -> id;
+    finger.version = ((struct store_header *) helper) -> structure_version;
+    finger.has_low = 0;
+    finger.has_high = 0;
+    // the deepest ancestor keys next to the path are the closest bounds
+    for (int level = path -> depth - 1; level > 0; level--){
+        Btree_Node * parent = path -> nodes[level - 1];
+        uint16_t slot = path -> slots[level];
+        if (finger.has_low == 0 && slot > 0){
+            finger.low = *(parent -> keys + slot - 1);
+            finger.has_low = 1;
         }
+        if (finger.has_high == 0 && slot < parent -> num_keys){
+            finger.high = *(parent -> keys + slot);
+            finger.has_high = 1;
+        }
+    }
+    finger.path.depth = path -> depth;
+    memcpy(finger.path.slots, path -> slots, sizeof(uint16_t) * path -> depth);
+    memcpy(finger.path.nodes, path -> nodes, sizeof(Btree_Node *) * path -> depth);
+}
+
+// 1 if key belongs to the leaf of the finger, tree lock held
+int finger_hit(btree_key_t key, void * helper){
+    struct store_header * store = (struct store_header *) helper;
+    if (finger.store_id != store -> id || finger.version != store -> structure_version){
+        return 0;
+    }
+    // a B+tree separator is the smallest key of the right subtree, a B-tree key is in the ancestor itself
+    if (finger.has_low && (key < finger.low || (key == finger.low && store -> mode != STORE_BPLUS_TREE))){
+        return 0;
+    }
+    if (finger.has_high && key >= finger.high){
+        return 0;
     }
+    store -> finger_hits += 1;
+    return 1;
+}
 
-    return NULL;
+// descend, from the leaf of the finger when the key is in its range
+int finger_descend(btree_key_t key, struct descent_path * path, void * helper){
+    if (finger_hit(key, helper)){
+        path -> depth = finger.path.depth;
+        memcpy(path -> slots, finger.path.slots, sizeof(uint16_t) * finger.path.depth);
+        memcpy(path -> nodes, finger.path.nodes, sizeof(Btree_Node *) * finger.path.depth);
+        Btree_Node * leaf = path -> nodes[path -> depth - 1];
+        uint16_t position = search_keys(leaf -> keys, leaf -> num_keys, key);
+        return position < leaf -> num_keys && *(leaf -> keys + position) == key;
+    }
+    int found = descend(key, path, helper);
+    if (path -> depth > 0){
+        finger_remember(path, helper);
+    }
+    return found;
 }
 
 
-int add_key_in_one_node(Btree_Node * node, uint32_t key, struct info* key_info_ptr){
+// key_info_ptr is copied into the node, it must not point into this node
+int add_key_in_one_node(Btree_Node * node, btree_key_t key, struct info* key_info_ptr){
     int num_keys = node -> num_keys;
     // search the position for the new key
-    uint16_t position = 0;
-    for (;position < num_keys ; position++){
-        uint32_t original_key = *(node -> keys + position);
-        if (key < original_key){
-            break;
-        }
-    }
+    uint16_t position = search_keys(node -> keys, num_keys, key);
 
     // move the key backward
     // move the keys_info backward
-    for (int i = num_keys - 1; i >= position; i--){
-        *(node -> keys + i + 1) = *(node -> keys + i);
-    }
-    for (int i = num_keys - 1; i >= position; i--){
-        *(node -> keys_info + i + 1) = *(node -> keys_info + i);
-    }
+    memmove(node -> keys + position + 1, node -> keys + position, sizeof(btree_key_t) * (num_keys - position));
+    memmove(node -> keys_info + position + 1, node -> keys_info + position, sizeof(struct info) * (num_keys - position));
 
     *(node -> keys + position) = key;
-    *(node -> keys_info + position) = key_info_ptr;
+    memcpy(node -> keys_info + position, key_info_ptr, sizeof(struct info));
 
     (node -> num_keys) += 1;
     return 1;
@@ -980,8 +1638,8 @@ int add_key_in_one_node(Btree_Node * node, uint32_t key, struct info* key_info_p
 
 // return the remaining key numbers in this node
 // if no such key, return -1
-int delete_key_in_one_node(Btree_Node * node, uint32_t key, int free_key_info){
-    // case 1, we delete the key that need to be delete, free data and keys_info
+int delete_key_in_one_node(Btree_Node * node, btree_key_t key, int free_removed, void * helper){
+    // case 1, we delete the key that need to be delete, free its data
     // case 2, we delete the key in one node and move it to another, no need to free
     uint16_t num_keys = node -> num_keys;
    
@@ -1006,21 +1664,14 @@ int delete_key_in_one_node(Btree_Node * node, uint32_t key, int free_key_info){
     // K0    K2     K3     0
     *(node -> keys + num_keys - 1) = 0;
 
-    struct info * removed_key_info = *(node -> keys_info + position);
-    // Before move the keys_info, we need to record the key_info, since we need to free it
-    // Move the keys_info ahead
-    for (uint16_t i = position; i < num_keys - 1; i++){
-        *(node -> keys_info + i) = *(node -> keys_info + i + 1);
+    // Before move the keys_info, we need to free the data of the removed one
+    if (free_removed == 1){
+        free_key_data(node -> keys_info + position, helper);
     }
-
-    *(node -> keys_info + num_keys - 1) = NULL;
+    // Move the keys_info ahead
+    memmove(node -> keys_info + position, node -> keys_info + position + 1, sizeof(struct info) * (num_keys - 1 - position));
 
     node->num_keys -= 1;
-
-    if (free_key_info == 1){
-        free(removed_key_info -> data);
-        free(removed_key_info);
-    }
     
     return node->num_keys;
 }
@@ -1039,178 +1690,183 @@ int need_split(Btree_Node* node, uint16_t branching){
 }
 
 
-void add_children(Btree_Node * left_child, Btree_Node * right_child, Btree_Node * original_child, Btree_Node * parent){
-    // since the position of the original_child
-    Btree_Node ** children_address_ptr = parent->children;
-    int position = 0;
-    for (;  *(children_address_ptr + position) != NULL; position++){
-        if (*(children_address_ptr + position) == original_child){
-            break;
-        }
-    }
+// put right_child into parent just after the child at position
+void add_children(Btree_Node * parent, uint16_t position, uint32_t right_child){
   
     // move all the children after it one position backward
-    for (int i = parent->num_keys; i >= position; i--){
-        *(parent -> children + i + 1) = *(parent -> children + i);
-    }
+    memmove(parent->children + position + 2, parent->children + position + 1, sizeof(uint32_t) * (parent->num_children - 1 - position));
 
-    *(children_address_ptr + position) = left_child;
-    *(children_address_ptr + position + 1) = right_child;
+    *(parent->children + position + 1) = right_child;
+    parent->num_children += 1;
 }
 
 
-void splitNode(Btree_Node* node, uint16_t branching, void *helper){
-    if (need_split(node, branching) == 0){
-        return;
+// Split the last node on the path if it has too many keys. The middle key goes up to the node above it
+// on the path, which may have to be split in turn, so the path is walked upward until a node fits.
+// A node with fan-out fan_out is refilled or merged when it has less keys than this after a delete.
+// ⌈b/2⌉ - 1 keeps the B-tree bounds. A lower watermark (store_config.merge_percent of the fan-out)
+// leaves room between merging and splitting, so keys going in and out at the same place do not
+// merge and split the same nodes again and again. A merge below it still fits in one node.
+int merge_watermark(uint16_t fan_out, void * helper){
+    int minimum = fan_out / 2 - 1 + fan_out % 2;
+    uint8_t merge_percent = ((struct store_header *) helper) -> merge_percent;
+    if (merge_percent == 0){
+        return minimum;
     }
+    int watermark = fan_out * merge_percent / 100;
+    if (watermark < 1){
+        watermark = 1;
+    }
+    return watermark < minimum ? watermark : minimum;
+}
 
-    uint16_t * num_nodes = (uint16_t *)(helper + 3); 
-    Btree_Node * new_left = initialize_Btree_node(branching, NULL);
-    Btree_Node * new_right = initialize_Btree_node(branching, NULL);
-
-    int num_keys = node -> num_keys;
-    int middle_key_index = 0;
-    if (num_keys % 2 == 0){
-        // 0 1 2 3. num is 4
-        // middle_key_index is 1, 4/2 -1
-        middle_key_index = num_keys / 2 - 1;
-        if (node->num_children != 0){
-            new_left->num_children = node->num_children /2;
-            new_right->num_children = node->num_children /2 + 1;
-        }
-        
-        
+// 1 if key was appended at the right edge of the tree and node is on that edge, -1 for the left
+// edge, 0 otherwise. The ancestors of node are not split yet, so their children still tell the edge.
+int append_edge(struct descent_path * path, int level, btree_key_t key){
+    Btree_Node * node = path -> nodes[level];
+    int right = node -> num_keys > 0 && key >= *(node -> keys + node -> num_keys - 1);
+    int left = node -> num_keys > 0 && key <= *(node -> keys);
+    for (int l = level; l > 0 && (right || left); l--){
+        right = right && path -> slots[l] == path -> nodes[l - 1] -> num_children - 1;
+        left = left && path -> slots[l] == 0;
+    }
+    return right ? 1 : (left ? -1 : 0);
+}
 
-    }else{
-        // 0 1 2 num is 3
-        // middle_key_index is 1, 
-        middle_key_index = num_keys / 2;
-        if (node->num_children != 0){
-            new_left->num_children = node->num_children /2;
-            new_right->num_children = node->num_children /2;
-        }
+// Keys the left node keeps when to_split keys are shared between two nodes. In the middle,
+// unless the split is at an edge of appends: then the node the appends go on to gets only
+// 100 - APPEND_SPLIT_PERCENT percent, the other one is left nearly full as no key will come to it.
+int split_left_keys(int to_split, int edge){
+    int small = to_split * (100 - APPEND_SPLIT_PERCENT) / 100;
+    if (small < 1){
+        small = 1;
     }
+    if (edge == 1){
+        return to_split - small;
+    }
+    if (edge == -1){
+        return small;
+    }
+    return to_split / 2;
+}
 
-    // add the keys (At the same time add keys_info)
-    // split children
-    for (int i = 0; i < num_keys; i++){
-        uint32_t key = *(node -> keys + i);
-        struct info * key_info_ptr = *((node -> keys_info) + i);
-        // keys                 0     1(m)   2     3
-        // children         c0    c1    c2     c3    c4
-        
-
-        // keys                 0      1(m)   2
-        // children         c0      c1    c2     c3
+// key is the key just inserted into the last node of path
+void splitNode(struct descent_path * path, uint16_t branching, btree_key_t key, void *helper){
+    uint64_t * num_nodes = &((struct store_header *) helper) -> num_nodes; 
+    uint16_t internal_branching = ((struct store_header *) helper) -> internal_branching;
 
-        if (i < middle_key_index){
-            add_key_in_one_node(new_left, key, key_info_ptr);
-            *(new_left->children + i) = *(node -> children + i);
-            if (*(new_left -> children + i) != NULL){
-                (*(new_left->children + i)) -> parent = new_left;
-            }
-            
+    for (int level = path -> depth - 1; level >= 0; level--){
+        Btree_Node * node = path -> nodes[level];
+        if (need_split(node, node -> keys_info == NULL ? internal_branching : branching) == 0){
+            return;
         }
-
-        else if (i == middle_key_index){
-            *(new_left->children + i) = *(node -> children + i);
-            if (*(new_left -> children + i) != NULL){
-                (*(new_left->children + i)) -> parent = new_left;
-            }
+        ((struct store_header *) helper) -> structure_version += 1;
+        ((struct store_header *) helper) -> splits += 1;
+        int edge = append_edge(path, level, key);
+        if (edge != 0){
+            ((struct store_header *) helper) -> append_splits += 1;
         }
 
-        else{
-            add_key_in_one_node(new_right, key, key_info_ptr);
-            *(new_right->children + i - middle_key_index - 1) = *(node -> children + i);
-            if(*(new_right->children + i - middle_key_index - 1) != NULL){
-                (*(new_right->children + i - middle_key_index - 1)) -> parent = new_right;
+        if (((struct store_header *) helper) -> mode == STORE_BPLUS_TREE){
+            btree_key_t separator = 0;
+            Btree_Node * new_right = split_bplus_node(node, edge, &separator, helper);
+            if (level > 0){
+                Btree_Node * parent = path -> nodes[level - 1];
+                (*num_nodes)++;
+                add_children(parent, path -> slots[level], new_right -> index);
+                add_separator_in_one_node(parent, separator);
+            }else{
+                (*num_nodes) += 2;
+                Btree_Node * new_root = allocate_internal_node(helper);
+                add_separator_in_one_node(new_root, separator);
+                *(new_root -> children + 0) = node -> index;
+                *(new_root -> children + 1) = new_right -> index;
+                new_root -> num_children = 2;
+                ((struct store_header *) helper) -> root = new_root;
             }
-            
+            continue;
         }
-    }
-    *(new_right->children + num_keys - middle_key_index - 1) = *(node -> children + num_keys);
-    if(*(new_right->children + num_keys - middle_key_index - 1) != NULL){
-        (*(new_right->children + num_keys - middle_key_index - 1)) -> parent = new_right;
-    }
-   
 
+        // node keeps the left half, the right half moves to a new node
+        Btree_Node * new_right = allocate_node(helper);
 
-    // add the middle key into its parent
-    Btree_Node * parent = node -> parent;
-    if (parent != NULL){
-        (*num_nodes)++;
+        int num_keys = node -> num_keys;
+        // 0 1 2 3. num is 4, middle_key_index is 1 unless at an edge, the middle key goes up
+        int middle_key_index = split_left_keys(num_keys - 1, edge);
+        int right_keys = num_keys - middle_key_index - 1;
 
-        add_children(new_left, new_right, node, parent);
-     
-        add_key_in_one_node(parent, *(node -> keys + middle_key_index), *(node -> keys_info + middle_key_index));
-        new_left -> parent = parent;
-        new_right -> parent = parent;
-        parent->num_children += 1;
-    }else{
-        (*num_nodes) += 2;
-        // create a new node as root, this middle one
-        Btree_Node * new_root = initialize_Btree_node(branching, NULL);
-        add_key_in_one_node(new_root, *(node -> keys + middle_key_index), *(node -> keys_info + middle_key_index));
-
-        *(new_root -> children + 0) = new_left;
-        *(new_root -> children + 1) = new_right;
+        // keys                 0     1(m)   2     3
+        // children         c0    c1    c2     c3    c4
+        memcpy(new_right -> keys, node -> keys + middle_key_index + 1, sizeof(btree_key_t) * right_keys);
+        memcpy(new_right -> keys_info, node -> keys_info + middle_key_index + 1, sizeof(struct info) * right_keys);
+        new_right -> num_keys = right_keys;
+        node -> num_keys = middle_key_index;
 
-        new_left -> parent = new_root;
-        new_right -> parent = new_root;
+        // split children, no child has to be told about its new parent
+        if (node->num_children != 0){
+            memcpy(new_right -> children, node -> children + middle_key_index + 1, sizeof(uint32_t) * (right_keys + 1));
+            memset(node -> children + middle_key_index + 1, '\0', sizeof(uint32_t) * (right_keys + 1));
+            node -> num_children = middle_key_index + 1;
+            new_right -> num_children = right_keys + 1;
+        }
 
-        // put the new root address into heapstart
+        // add the middle key into its parent, the slot is still in node after num_keys
+        if (level > 0){
+            Btree_Node * parent = path -> nodes[level - 1];
+            (*num_nodes)++;
 
-        Btree_Node ** root_ptr = (Btree_Node **) (helper + 5);
-        *root_ptr = new_root;
-        new_root ->num_children = 2;
+            add_children(parent, path -> slots[level], new_right -> index);
+            add_key_in_one_node(parent, *(node -> keys + middle_key_index), node -> keys_info + middle_key_index);
+        }else{
+            (*num_nodes) += 2;
+            // create a new node as root, this middle one
+            Btree_Node * new_root = allocate_node(helper);
+            add_key_in_one_node(new_root, *(node -> keys + middle_key_index), node -> keys_info + middle_key_index);
+
+            *(new_root -> children + 0) = node -> index;
+            *(new_root -> children + 1) = new_right -> index;
+            new_root ->num_children = 2;
+
+            // put the new root address into the store header
+            Btree_Node ** root_ptr = &((struct store_header *) helper) -> root;
+            *root_ptr = new_root;
+        }
     }
-    
-
-    // free the original node
-    // children pointers are copied into new node
-    // SO just need to free
-
-    // At this place, we can not free the total node originally
-    // We only need to free keys since keys are copied to new node, 
-    // but the pointer in keys_info and child can't.
-    // just free the space, not the address in keys_info and child
-    // free_one_node(&node);
-
-    free(node -> keys);
-    free(node -> keys_info);
-    free(node -> children);
-    free(node);
-
-    splitNode(parent, branching, helper);
-
 }
 
 
-Btree_Node* recursive_find(uint32_t target_key, struct info * found, Btree_Node * root){
-    Btree_Node * cur = root;
+Btree_Node* recursive_find(btree_key_t target_key, struct info * found, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node * cur = ((struct store_header *) helper) -> root;
 
-    if (cur == NULL){
+    // inside the range of the finger the key can only be in its leaf
+    if (finger_hit(target_key, helper)){
+        Btree_Node * leaf = finger.path.nodes[finger.path.depth - 1];
+        uint16_t position = search_keys(leaf -> keys, leaf -> num_keys, target_key);
+        if (position < leaf -> num_keys && *(leaf -> keys + position) == target_key
+            && is_tombstone(leaf -> keys_info + position) == 0){
+            *found = *(leaf -> keys_info + position);
+            return leaf;
+        }
         return NULL;
     }
-    
 
-    for (int i = 0; i < cur -> num_keys; i++){
-        
-        if (*(cur -> keys + i) == target_key){
-            *found = **(cur -> keys_info + i);
-            return cur;
-        }
-        
-        if (target_key < *(cur -> keys + i)){
-            return recursive_find(target_key, found, *(cur -> children + i));
-            break;
-        }
+    // leaves have NO_NODE children, so the walk ends there if the key is missing
+    while (cur != NULL){
+        uint16_t position = search_keys(cur -> keys, cur -> num_keys, target_key);
 
-        if (i == cur -> num_keys - 1 && target_key > *(cur -> keys + i)){
-            return recursive_find(target_key, found, *(cur -> children + i + 1));
-            break;
+        if (position < cur -> num_keys && *(cur -> keys + position) == target_key){
+            if (cur -> keys_info == NULL){
+                position += 1;
+            }else if (is_tombstone(cur -> keys_info + position)){
+                return NULL;
+            }else{
+                *found = *(cur -> keys_info + position);
+                return cur;
+            }
         }
 
+        cur = peek_node(nodes, *(cur -> children + position));
     }
 
     return NULL;
@@ -1220,27 +1876,61 @@ Btree_Node* recursive_find(uint32_t target_key, struct info * found, Btree_Node
 
 
 
-void find_maximum_node(Btree_Node* root, Btree_Node** res, uint32_t* maximum_key){
+// the slot of a key, NULL if the key is not in the tree. The slot can be changed
+struct info * find_key_info(btree_key_t target_key, void * helper){
+    return key_info_through(target_key, &node_at, helper);
+}
+
+// the slot of a key for reading only, chunks a snapshot shares are not copied
+struct info * peek_key_info(btree_key_t target_key, void * helper){
+    return key_info_through(target_key, &peek_node, helper);
+}
+
+struct info * key_info_through(btree_key_t target_key, node_lookup lookup, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node * cur = ((struct store_header *) helper) -> root;
+    while (cur != NULL){
+        uint16_t position = search_keys(cur -> keys, cur -> num_keys, target_key);
+        if (position < cur -> num_keys && *(cur -> keys + position) == target_key){
+            if (cur -> keys_info == NULL){
+                position += 1;
+            }else if (is_tombstone(cur -> keys_info + position)){
+                return NULL;
+            }else{
+                return cur -> keys_info + position;
+            }
+        }
+        cur = lookup(nodes, *(cur -> children + position));
+    }
+    return NULL;
+}
+
+
+// The maximum key of a subtree is the last key on its rightmost path, the path is pushed onto path
+// root is the child at slot root_slot of the last node on the path
+void find_maximum_node(Btree_Node* root, uint16_t root_slot, struct descent_path * path, btree_key_t* maximum_key, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
     Btree_Node * cur = root;
     if (cur == NULL){
         return;
     }
 
-    for (int i = 0; i < cur -> num_keys; i++){
-        if (*(cur->keys + i) > *maximum_key){
-            *maximum_key = *(cur->keys + i);
-            *res = cur;
-        }
+    path -> nodes[path -> depth] = cur;
+    path -> slots[path -> depth] = root_slot;
+    path -> depth += 1;
+    while (cur -> num_children != 0){
+        uint16_t last = cur -> num_keys;
+        cur = node_at(nodes, *(cur -> children + last));
+        path -> nodes[path -> depth] = cur;
+        path -> slots[path -> depth] = last;
+        path -> depth += 1;
     }
 
-    for (int i = 0; i < cur -> num_keys + 1; i++){
-        Btree_Node * child = *(cur -> children + i);
-        find_maximum_node(child, res, maximum_key);
-    }
+    *maximum_key = *(cur->keys + cur->num_keys - 1);
 }
 
 
-void swap_key(uint32_t key1, Btree_Node* node1, uint32_t key2, Btree_Node* node2){
+void swap_key(btree_key_t key1, Btree_Node* node1, btree_key_t key2, Btree_Node* node2){
     uint16_t position1 = 0;
     uint16_t position2 = 0;
     
@@ -1250,71 +1940,78 @@ void swap_key(uint32_t key1, Btree_Node* node1, uint32_t key2, Btree_Node* node2
     *(node1->keys + position1) = key2;
     *(node2->keys + position2) = key1;
 
-    struct info * tmp = *(node1->keys_info + position1);
-    *(node1->keys_info + position1) = *(node2->keys_info + position2);
-    *(node2->keys_info + position2) = tmp;
+    struct info tmp;
+    memcpy(&tmp, node1->keys_info + position1, sizeof(struct info));
+    memcpy(node1->keys_info + position1, node2->keys_info + position2, sizeof(struct info));
+    memcpy(node2->keys_info + position2, &tmp, sizeof(struct info));
 }
 
 
 
-void replace_key(Btree_Node* node_replaced, uint32_t key_replaced, Btree_Node* node, u_int32_t key){
+void replace_key(Btree_Node* node_replaced, btree_key_t key_replaced, Btree_Node* node, btree_key_t key){
     uint16_t position_r;
     uint16_t position;
     find_position_of_key(node_replaced, key_replaced, &position_r);
     find_position_of_key(node, key, &position);
 
     *(node_replaced->keys + position_r) = *(node->keys + position);
-    *(node_replaced->keys_info + position_r) = *(node->keys_info + position);
+    memcpy(node_replaced->keys_info + position_r, node->keys_info + position, sizeof(struct info));
 
 }
 
-void merge_two_nodes(Btree_Node* target, Btree_Node* node_be_merged, void *helper){
-
-    for (uint16_t i = 0; i < node_be_merged -> num_keys; i++){
-        uint32_t key = *(node_be_merged->keys + i);
-        struct info* key_info = *(node_be_merged->keys_info + i);
-        add_key_in_one_node(target, key, key_info);
-        
-    }
-
-    
-
-    if (target->num_children != 0){
-        // not a leaf, merge children and change their parent
-
-        for (int i = target->num_children; i < target->num_children + node_be_merged->num_children; i++){
-            *(target->children + i) = *(node_be_merged->children + i - (target->num_children));
-            (*(node_be_merged->children + i - (target->num_children))) -> parent = target;
+// merge the child at merged_position into its sibling at target_position
+void merge_two_nodes(Btree_Node* parent, uint16_t target_position, uint16_t merged_position, void *helper){
+    ((struct store_header *) helper) -> merges += 1;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node* target = node_at(nodes, *(parent->children + target_position));
+    Btree_Node* node_be_merged = node_at(nodes, *(parent->children + merged_position));
+
+    // keys, keys_info and children of a left sibling go in front of the ones of target,
+    // the ones of a right sibling go after them
+    uint16_t merged_keys = node_be_merged->num_keys;
+    uint16_t merged_children = node_be_merged->num_children;
+
+    if (merged_position < target_position){
+        memmove(target->keys + merged_keys, target->keys, sizeof(btree_key_t) * target->num_keys);
+        memcpy(target->keys, node_be_merged->keys, sizeof(btree_key_t) * merged_keys);
+        if (target->keys_info != NULL){
+            memmove(target->keys_info + merged_keys, target->keys_info, sizeof(struct info) * target->num_keys);
+            memcpy(target->keys_info, node_be_merged->keys_info, sizeof(struct info) * merged_keys);
         }
 
-        target->num_children += node_be_merged->num_children;
+        memmove(target->children + merged_children, target->children, sizeof(uint32_t) * target->num_children);
+        memcpy(target->children, node_be_merged->children, sizeof(uint32_t) * merged_children);
+    }else{
+        memcpy(target->keys + target->num_keys, node_be_merged->keys, sizeof(btree_key_t) * merged_keys);
+        if (target->keys_info != NULL){
+            memcpy(target->keys_info + target->num_keys, node_be_merged->keys_info, sizeof(struct info) * merged_keys);
+        }
+        memcpy(target->children + target->num_children, node_be_merged->children, sizeof(uint32_t) * merged_children);
     }
+    target->num_keys += merged_keys;
+    target->num_children += merged_children;
   
     // the we delete the node_be_merged
-    // 1. delete its address in parent
+    // 1. delete its index in parent
     // 2. free the node, not free the key_info and data
     // 3. num_node --
 
-    delete_one_node(&node_be_merged, helper);
+    delete_one_node(parent, merged_position, helper);
 
 }
 
 // left most is 0, rightmost is 1
-void move_child(Btree_Node * dest_node, Btree_Node *child, Btree_Node * original_node, int leftmost_or_rightmost){
-    uint16_t position;
-    find_position_of_child(original_node, child, &position);
+// child is the first child of original_node if leftmost_or_rightmost is 1, its last child otherwise
+void move_child(Btree_Node * dest_node, uint32_t child, Btree_Node * original_node, int leftmost_or_rightmost){
     if (leftmost_or_rightmost == 1){
         // move leftmost child to rightmost
-        // original node's children: leftmost -> NULL, move all the children one position ahead, num_children--
+        // original node's children: leftmost -> NO_NODE, move all the children one position ahead, num_children--
         
         // update the children in original_node
-        for (;position < original_node->num_children - 1; position++){
-            *(original_node->children + position) = *(original_node->children + position + 1);
-        }
-        original_node->num_children -= 1;
-    }else{
-        original_node->num_children -= 1;
+        memmove(original_node->children, original_node->children + 1, sizeof(uint32_t) * (original_node->num_children - 1));
     }
+    original_node->num_children -= 1;
+    *(original_node->children + original_node->num_children) = NO_NODE;
 
     // update the new parent's child
     if (leftmost_or_rightmost == 1){
@@ -1323,13 +2020,9 @@ void move_child(Btree_Node * dest_node, Btree_Node *child, Btree_Node * original
     }else{
         // put the child int leftmost
         // need to move all the child right first
-        for(int i = dest_node->num_keys - 1; i >= 0 ; i--){
-            *(dest_node-> children + i + 1) = *(dest_node->children + i);
-        }
+        memmove(dest_node->children + 1, dest_node->children, sizeof(uint32_t) * dest_node->num_keys);
         *(dest_node->children) = child;
     }
-    
-    child->parent = dest_node;
 
     dest_node->num_children += 1;
     
@@ -1337,24 +2030,24 @@ void move_child(Btree_Node * dest_node, Btree_Node *child, Btree_Node * original
 }
 
 
-void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* last_child, void* helper){
+// internal_node is path->nodes[level], its parent is the node above it on the path
+void balance_internal(struct descent_path * path, int level, int min_key_num, Btree_Node* last_child, void* helper){
+    Btree_Node *internal_node = path -> nodes[level];
     if (internal_node->num_keys >= min_key_num){
         return; 
     }
-    if (internal_node->parent == NULL){
+    if (level == 0){
         if (internal_node->num_keys == 0){
             
             // simply removed the node and update the new root which is the merged child
             // remember to update the helper
-            Btree_Node* original_root = *((Btree_Node **) (helper + 5));
+            Btree_Node* original_root = ((struct store_header *) helper) -> root;
             
-            *((Btree_Node **) (helper + 5)) = last_child;
-     
-            last_child->parent = NULL;
+            ((struct store_header *) helper) -> root = last_child;
 
-            free_one_node(&original_root);
+            free_one_node(&original_root, helper);
             
-            uint16_t * num_nodes = (uint16_t *)(helper + 3); 
+            uint64_t * num_nodes = &((struct store_header *) helper) -> num_nodes; 
             (*num_nodes) -= 1;
             return;
         }else{
@@ -1362,38 +2055,38 @@ void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* la
         }
     }
 
-    Btree_Node* parent = internal_node->parent;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node* parent = path -> nodes[level - 1];
     Btree_Node* left_sibling = NULL;
-    uint32_t key_left = 0;
+    btree_key_t key_left = 0;
     struct info* key_left_info = NULL;
 
     Btree_Node* right_sibling = NULL;
-    uint32_t key_right = 0;
+    btree_key_t key_right = 0;
     struct info* key_right_info = NULL;
 
 
     // 1. find position of current node, if it is leftmost(0), we just consider right sibling
     //    if there are no left sibling has more than min_key_num, consider right sibling
-    uint16_t index = 0;
-    find_position_of_child(internal_node->parent, internal_node, &index);
+    uint16_t index = path -> slots[level];
     // leftmost, 
     if (index == 0){
-        right_sibling = *(parent->children + 1 + index);
+        right_sibling = node_at(nodes, *(parent->children + 1 + index));
         //   correct at this stage 
         key_right = *(parent->keys + index);
-        uint32_t key_right_child = *(right_sibling->keys);
-        key_right_info = *(parent->keys_info + index);
-        struct info* key_right_child_info = *(right_sibling->keys_info);
+        btree_key_t key_right_child = *(right_sibling->keys);
+        key_right_info = parent->keys_info + index;
+        struct info* key_right_child_info = right_sibling->keys_info;
 
         // find the smallest child of right_sibling
-        Btree_Node* child_smallest = *(right_sibling->children);
+        uint32_t child_smallest = *(right_sibling->children);
 
         if (right_sibling->num_keys > min_key_num){
             // key_right is the key in parent split it
             add_key_in_one_node(internal_node, key_right, key_right_info);
-            delete_key_in_one_node(parent, key_right, 0);
+            delete_key_in_one_node(parent, key_right, 0, helper);
             add_key_in_one_node(parent, key_right_child, key_right_child_info);
-            delete_key_in_one_node(right_sibling, key_right_child, 0);
+            delete_key_in_one_node(right_sibling, key_right_child, 0, helper);
             
             move_child(internal_node, child_smallest, right_sibling, 1);
             return;
@@ -1402,35 +2095,35 @@ void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* la
             
             add_key_in_one_node(internal_node, key_right, key_right_info);
       
-            delete_key_in_one_node(parent, key_right, 0);
+            delete_key_in_one_node(parent, key_right, 0, helper);
           
             
-            merge_two_nodes(internal_node, right_sibling, helper);
+            merge_two_nodes(parent, index, index + 1, helper);
 
-            balance_internal(parent, min_key_num, internal_node, helper);
+            balance_internal(path, level - 1, min_key_num, internal_node, helper);
         }
         
 
     }
     // rightmost
-    else if (index == internal_node->parent->num_keys){
-        left_sibling = *(parent->children + index - 1);
+    else if (index == parent->num_keys){
+        left_sibling = node_at(nodes, *(parent->children + index - 1));
         key_left = *(parent->keys + index - 1);
         // last key in left_sibling
-        uint32_t key_left_child = *(left_sibling->keys + left_sibling->num_keys - 1);
-        key_left_info = *(parent->keys_info + index - 1);
-        struct info* key_left_child_info = *(left_sibling->keys_info + left_sibling->num_keys - 1);
+        btree_key_t key_left_child = *(left_sibling->keys + left_sibling->num_keys - 1);
+        key_left_info = parent->keys_info + index - 1;
+        struct info* key_left_child_info = left_sibling->keys_info + left_sibling->num_keys - 1;
 
         // find the largest child of left_sibling
-        Btree_Node* child_largest = *(left_sibling->children + left_sibling->num_keys);
+        uint32_t child_largest = *(left_sibling->children + left_sibling->num_keys);
 
         if (left_sibling-> num_keys > min_key_num){
             add_key_in_one_node(internal_node, key_left, key_left_info);
-            delete_key_in_one_node(parent, key_left, 0);
+            delete_key_in_one_node(parent, key_left, 0, helper);
             add_key_in_one_node(parent, key_left_child, key_left_child_info);
-            delete_key_in_one_node(left_sibling, key_left_child, 0);
+            delete_key_in_one_node(left_sibling, key_left_child, 0, helper);
 
-            move_child(internal_node, child_largest, left_sibling, 1);
+            move_child(internal_node, child_largest, left_sibling, 0);
             return;
         }
 
@@ -1438,13 +2131,13 @@ void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* la
             // can only merge with left sibling
             add_key_in_one_node(internal_node, key_left, key_left_info);
             // delete it from parent node, not free the key info
-            delete_key_in_one_node(parent, key_left, 0);
+            delete_key_in_one_node(parent, key_left, 0, helper);
             // move all keys in immediate sibling to target node,
            
-            merge_two_nodes(internal_node, left_sibling, helper);
+            merge_two_nodes(parent, index, index - 1, helper);
          
             // After this step, there will be internal nodes
-            balance_internal(parent, min_key_num, internal_node, helper);
+            balance_internal(path, level - 1, min_key_num, internal_node, helper);
         }
         
 
@@ -1452,43 +2145,43 @@ void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* la
     }
     // middle
     else{
-        left_sibling = *(parent->children + index - 1);
+        left_sibling = node_at(nodes, *(parent->children + index - 1));
         key_left = *(parent->keys + index - 1);
         // last key in left_sibling
-        uint32_t key_left_child = *(left_sibling->keys + left_sibling->num_keys - 1);
-        key_left_info = *(parent->keys_info + index - 1);
-        struct info* key_left_child_info = *(left_sibling->keys_info + left_sibling->num_keys - 1);
+        btree_key_t key_left_child = *(left_sibling->keys + left_sibling->num_keys - 1);
+        key_left_info = parent->keys_info + index - 1;
+        struct info* key_left_child_info = left_sibling->keys_info + left_sibling->num_keys - 1;
 
         // find the largest child of left_sibling
-        Btree_Node* child_largest = *(left_sibling->children + left_sibling->num_keys);
+        uint32_t child_largest = *(left_sibling->children + left_sibling->num_keys);
 
         if (left_sibling-> num_keys > min_key_num){
             add_key_in_one_node(internal_node, key_left, key_left_info);
-            delete_key_in_one_node(parent, key_left, 0);
+            delete_key_in_one_node(parent, key_left, 0, helper);
 
             add_key_in_one_node(parent, key_left_child, key_left_child_info);
-            delete_key_in_one_node(left_sibling, key_left_child, 0);
+            delete_key_in_one_node(left_sibling, key_left_child, 0, helper);
 
-            move_child(internal_node, child_largest, left_sibling, 1);
+            move_child(internal_node, child_largest, left_sibling, 0);
            
             return;
         }
 
-        right_sibling = *(parent->children + 1 + index);
+        right_sibling = node_at(nodes, *(parent->children + 1 + index));
         //   correct at this stage 
         key_right = *(parent->keys + index);
-        uint32_t key_right_child = *(right_sibling->keys);
-        key_right_info = *(parent->keys_info + index);
-        struct info* key_right_child_info = *(right_sibling->keys_info);
+        btree_key_t key_right_child = *(right_sibling->keys);
+        key_right_info = parent->keys_info + index;
+        struct info* key_right_child_info = right_sibling->keys_info;
 
         // find the smallest child of right_sibling
-        Btree_Node* child_smallest = *(right_sibling->children);
+        uint32_t child_smallest = *(right_sibling->children);
         if (right_sibling->num_keys > min_key_num){
             // key_right is the key in parent split it
             add_key_in_one_node(internal_node, key_right, key_right_info);
-            delete_key_in_one_node(parent, key_right, 0);
+            delete_key_in_one_node(parent, key_right, 0, helper);
             add_key_in_one_node(parent, key_right_child, key_right_child_info);
-            delete_key_in_one_node(right_sibling, key_right_child, 0);
+            delete_key_in_one_node(right_sibling, key_right_child, 0, helper);
 
             move_child(internal_node, child_smallest, right_sibling, 1);
             return;
@@ -1497,13 +2190,13 @@ void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* la
             // both exists, merge with left sibling first;
             add_key_in_one_node(internal_node, key_left, key_left_info);
             // delete it from parent node, not free the key info
-            delete_key_in_one_node(parent, key_left, 0);
+            delete_key_in_one_node(parent, key_left, 0, helper);
             // move all keys in immediate sibling to target node,
            
-            merge_two_nodes(internal_node, left_sibling, helper);
+            merge_two_nodes(parent, index, index - 1, helper);
          
             // After this step, there will be internal nodes
-            balance_internal(parent, min_key_num, internal_node, helper);
+            balance_internal(path, level - 1, min_key_num, internal_node, helper);
         }
 
     }
@@ -1513,30 +2206,1731 @@ void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* la
 
 
 
-void preorder(Btree_Node * root, struct node *list, int num_nodes){
-    Btree_Node* cur = root;
-    if (cur == NULL){
+// up to TOMBSTONE_BATCH keys of tombstones in a subtree
+void collect_tombstones(Btree_Node * root, btree_key_t * keys, uint64_t * count, void * helper){
+    if (root == NULL || *count == TOMBSTONE_BATCH){
         return;
     }
-    
-    for (int i = 0; i < num_nodes ; i++){
-        struct node *n = list + i;
-        
-        if (n -> num_keys == 0){
- 
-            n -> num_keys = cur -> num_keys;
-            n -> keys = (uint32_t *) malloc(cur->num_keys * sizeof(uint32_t));
+    if (root -> keys_info != NULL){
+        for (uint16_t i = 0; i < root -> num_keys && *count < TOMBSTONE_BATCH; i++){
+            if (is_tombstone(root -> keys_info + i)){
+                *(keys + *count) = *(root -> keys + i);
+                *count += 1;
+            }
+        }
+    }
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        collect_tombstones(peek_node(((struct store_header *) helper) -> nodes, *(root -> children + i)), keys, count, helper);
+    }
+}
 
-            memcpy(n->keys, cur->keys, cur->num_keys * sizeof(uint32_t));
-            break;
+void tree_stats_subtree(Btree_Node * root, struct tree_stats * stats, void * helper){
+    if (root == NULL){
+        return;
+    }
+    stats -> num_nodes += 1;
+    stats -> num_keys += root -> num_keys;
+    if (root -> num_children == 0){
+        stats -> num_leaves += 1;
+        stats -> leaf_keys += root -> num_keys;
+        return;
+    }
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        tree_stats_subtree(peek_node(((struct store_header *) helper) -> nodes, *(root -> children + i)), stats, helper);
+    }
+}
+
+// Copies the keys of node into keys, tombstones are deleted keys already. Returns the number copied.
+uint16_t copy_live_keys(Btree_Node * node, btree_key_t * keys){
+    uint16_t count = 0;
+    for (uint16_t j = 0; j < node -> num_keys; j++){
+        if (node -> keys_info == NULL || is_tombstone(node -> keys_info + j) == 0){
+            *(keys + count) = *(node -> keys + j);
+            count += 1;
         }
     }
- 
-    for (uint16_t i = 0; i < cur -> num_keys + 1; i++){
-        Btree_Node* child = *(cur->children + i);
-        preorder(child, list, num_nodes);
+    return count;
+}
+
+// Extends the path along first children until it is depth nodes long. 0 if the leaves are above that depth.
+int descend_leftmost(struct descent_path * path, uint16_t depth, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    while (path -> depth < depth){
+        Btree_Node * node = path -> nodes[path -> depth - 1];
+        if (node -> num_children == 0){
+            return 0;
+        }
+        path -> nodes[path -> depth] = peek_node(nodes, *(node -> children));
+        path -> slots[path -> depth] = 0;
+        path -> depth += 1;
+    }
+    return 1;
+}
+
+// Moves the end of the path to the next node of the walk in the given order. 0 when the walk is over.
+//     preorder: the first child, else the next sibling of the node or of its closest ancestor that has one
+//     level order: the next node at the same depth, else the leftmost node one level down
+int next_in_order(struct descent_path * path, uint8_t order, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    uint16_t depth = path -> depth;
+    if (order == EXPORT_PREORDER && descend_leftmost(path, depth + 1, helper)){
+        return 1;
+    }
+
+    uint16_t level = depth - 1;
+    while (level > 0 && path -> slots[level] + 1 >= path -> nodes[level - 1] -> num_children){
+        level--;
+    }
+    if (level == 0){
+        if (order == EXPORT_PREORDER){
+            return 0;
+        }
+        path -> depth = 1;
+        return descend_leftmost(path, depth + 1, helper);
+    }
+    path -> slots[level] += 1;
+    path -> nodes[level] = peek_node(nodes, *(path -> nodes[level - 1] -> children + path -> slots[level]));
+    path -> depth = level + 1;
+    if (order == EXPORT_LEVEL_ORDER){
+        descend_leftmost(path, depth, helper);
+    }
+    return 1;
+}
+
+// Writes root at list + *next_node and its live keys at *next_key, then its subtrees, advancing both
+void preorder(Btree_Node * root, struct node * list, uint64_t * next_node, btree_key_t ** next_key, void * helper){
+    if (root == NULL){
+        return;
+    }
+
+    struct node * n = list + *next_node;
+    *next_node += 1;
+    n -> keys = *next_key;
+    n -> num_keys = copy_live_keys(root, n -> keys);
+    *next_key += n -> num_keys;
+
+    // the children are scattered in the arena, start loading all of them before walking the first
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        __builtin_prefetch(peek_node(nodes, *(root -> children + i)));
+    }
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        preorder(peek_node(nodes, *(root -> children + i)), list, next_node, next_key, helper);
+    }
+}
+
+
+
+// ######## Snapshots ############
+//
+// A snapshot is a store header of its own, read-only, so every reading function takes it as helper
+// and reads it without the tree lock. Writes to it return 1. The store goes on changing: the first
+// change to a node in a chunk the snapshot shares copies the chunk for the store (node_at), and a chunk
+// is freed once neither the store nor any snapshot has it. The snapshot pins every value segment, so
+// btree_update writes new ciphertexts elsewhere and compaction leaves the old ones where they are.
+// Release every snapshot before close_store of its store.
+
+void * btree_snapshot(void * helper){
+    struct store_header * store = (struct store_header *) helper;
+    struct store_snapshot * snapshot = (struct store_snapshot *) malloc(sizeof(struct store_snapshot));
+    struct store_header * view = &snapshot -> view;
+    if (store -> read_only){
+        free(snapshot);
+        return NULL;
+    }
+
+    lock_at_start();
+    memcpy(view, store, sizeof(struct store_header));
+    view -> nodes = node_arena_share(store -> nodes);
+    view -> filter = NULL;
+    view -> read_only = 1;
+    view -> id = __atomic_fetch_add(&next_store_id, 1, __ATOMIC_RELAXED);
+    snapshot -> store = store;
+    snapshot -> segments = arena_pin_all(store -> arena, &snapshot -> num_segments, &snapshot -> used);
+
+    // the store reaches its root and the nodes of fingers without node_at, they get their own copies now
+    if (store -> root != NULL){
+        store -> root = node_at(store -> nodes, store -> root -> index);
+    }
+    store -> structure_version += 1;
+    pthread_mutex_unlock(&lock);
+    return snapshot;
+}
+
+void btree_snapshot_release(void * snapshot){
+    struct store_snapshot * released = (struct store_snapshot *) snapshot;
+    struct store_header * store = released -> store;
+
+    // chunks the store copied away from are freed now, anything that kept a node of the store
+    // between two holds of the lock checks structure_version and finds it again
+    lock_at_start();
+    node_arena_destroy(released -> view.nodes);
+    store -> nodes -> snapshots -= 1;
+    store -> structure_version += 1;
+    pthread_mutex_unlock(&lock);
+    arena_unpin_all(store -> arena, released -> segments, released -> num_segments);
+    free(released -> used);
+    free(released);
+}
+
+
+
+// ######## Save and load ############
+//
+// A saved store is one file:
+//     | struct save_header | chunks of the node arena | struct saved_segment[num_segments] | segment bytes |
+// The chunks are written as they are, except that the pointers of every node to its own arrays become
+// offsets from the node (node_arrays_to_offsets) and info.data becomes the segment index above
+// SAVED_OFFSET_BITS and the offset in the segment below. Ciphertexts, the rest of struct info and the
+// entry heads are written untouched, so btree_load decrypts and encrypts nothing: it maps the file,
+// copies chunks and segments in bulk and sets the pointers back in one pass over the nodes.
+// btree_save writes a snapshot, so writers go on while it is saved.
+
+// Mixes 8 bytes at a time into sum, for the checksums of a saved file
+uint64_t checksum_bytes(const void * data, uint64_t length, uint64_t sum){
+    const uint64_t * words = (const uint64_t *) data;
+    uint64_t num_words = length / 8;
+    for (uint64_t i = 0; i < num_words; i++){
+        sum = (sum ^ *(words + i)) * 0x100000001b3ULL;
+        sum ^= sum >> 29;
+    }
+    if (length % 8 != 0){
+        uint64_t last = 0;
+        memcpy(&last, words + num_words, length % 8);
+        sum = (sum ^ last) * 0x100000001b3ULL;
+        sum ^= sum >> 29;
+    }
+    return sum;
+}
+
+// 1 for the nodes on the free list of nodes, the others below next_unused are in the tree
+uint8_t * free_nodes(struct node_arena * nodes){
+    uint8_t * is_free = (uint8_t *) calloc(nodes -> next_unused, 1);
+    for (uint32_t index = nodes -> free_list; index != NO_NODE; index = *((uint32_t *) peek_node(nodes, index))){
+        *(is_free + index) = 1;
+    }
+    return is_free;
+}
+
+// writes length bytes and adds them to the checksum, 1 if the write failed
+int write_section(FILE * file, const void * data, uint64_t length, uint64_t * checksum){
+    *checksum = checksum_bytes(data, length, *checksum);
+    return fwrite(data, 1, length, file) != length;
+}
+
+// Writes the store, or a snapshot, to path. Returns 0, 1 if the file could not be written.
+// The file is written next to path as path.tmp and renamed over path once it is on disk, so a save
+// that fails or is cut short leaves the last good file at path.
+int btree_save(const char * path, void * helper){
+    struct store_snapshot * snapshot = (struct store_snapshot *) helper;
+    int own_snapshot = ((struct store_header *) helper) -> read_only == 0;
+    char * temp_path = (char *) malloc(strlen(path) + sizeof(".tmp"));
+    sprintf(temp_path, "%s.tmp", path);
+    FILE * file = fopen(temp_path, "wb");
+    if (file == NULL){
+        free(temp_path);
+        return 1;
+    }
+    if (own_snapshot){
+        snapshot = (struct store_snapshot *) btree_snapshot(helper);
+    }
+
+    struct store_header * view = &snapshot -> view;
+    struct node_arena * nodes = view -> nodes;
+    uint64_t chunk_bytes = (uint64_t) nodes -> nodes_per_chunk * nodes -> node_bytes;
+    struct save_header header;
+    memset(&header, '\0', sizeof(struct save_header));
+    memcpy(header.magic, SAVE_MAGIC, sizeof(header.magic));
+    header.format_version = SAVE_FORMAT_VERSION;
+    header.key_bits = BTREE_KEY_BITS;
+    header.node_bytes = nodes -> node_bytes;
+    header.nodes_per_chunk = nodes -> nodes_per_chunk;
+    header.num_chunks = nodes -> num_chunks;
+    header.next_unused = nodes -> next_unused;
+    header.free_list = nodes -> free_list;
+    header.root = view -> root == NULL ? NO_NODE : view -> root -> index;
+    header.num_segments = snapshot -> num_segments;
+    header.branching = view -> branching;
+    header.internal_branching = view -> internal_branching;
+    header.n_processors = view -> n_processors;
+    header.mode = view -> mode;
+    header.value_mode = view -> value_mode;
+    header.tombstone_deletes = view -> tombstone_deletes;
+    header.merge_percent = view -> merge_percent;
+    header.filter_bits_per_key = snapshot -> store -> filter == NULL ? 0 : snapshot -> store -> filter -> bits_per_key;
+    header.num_nodes = view -> num_nodes;
+    header.tombstones = view -> tombstones;
+    int failed = fwrite(&header, 1, sizeof(struct save_header), file) != sizeof(struct save_header);
+
+    // the segments by index, to turn info.data into an offset
+    uint32_t max_index = 0;
+    for (uint32_t i = 0; i < snapshot -> num_segments; i++){
+        if ((*(snapshot -> segments + i)) -> index > max_index){
+            max_index = (*(snapshot -> segments + i)) -> index;
+        }
+    }
+    char ** bases = (char **) calloc(max_index + 1, sizeof(char *));
+    for (uint32_t i = 0; i < snapshot -> num_segments; i++){
+        *(bases + (*(snapshot -> segments + i)) -> index) = (*(snapshot -> segments + i)) -> base;
+    }
+
+    uint8_t * is_free = free_nodes(nodes);
+    char * buffer = (char *) malloc(chunk_bytes);
+    uint64_t checksum = 0;
+    for (uint32_t c = 0; c < nodes -> num_chunks && failed == 0; c++){
+        memcpy(buffer, *(nodes -> chunks + c), chunk_bytes);
+        for (uint32_t i = 0; i < nodes -> nodes_per_chunk; i++){
+            uint64_t index = (uint64_t) c * nodes -> nodes_per_chunk + i;
+            if (index == NO_NODE || index >= nodes -> next_unused){
+                continue;
+            }
+            Btree_Node * node = (Btree_Node *) (buffer + (uint64_t) i * nodes -> node_bytes);
+            const Btree_Node * from = (const Btree_Node *) (*(nodes -> chunks + c) + (uint64_t) i * nodes -> node_bytes);
+            if (*(is_free + index) == 0 && node -> keys_info != NULL){
+                struct info * slots = (struct info *) ((char *) node + ((char *) node -> keys_info - (const char *) from));
+                for (uint16_t j = 0; j < node -> num_keys; j++){
+                    struct info * slot = slots + j;
+                    if (is_tombstone(slot)){
+                        slot -> data = NULL;
+                    }else if (value_is_inline(slot) == 0){
+                        uint32_t segment = (((struct arena_entry *) slot -> data) - 1) -> segment;
+                        uint64_t offset = (char *) slot -> data - *(bases + segment);
+                        slot -> data = (void *) (((uint64_t) segment << SAVED_OFFSET_BITS) | offset);
+                    }
+                }
+            }
+            node_arrays_to_offsets(node, from, nodes -> node_bytes);
+        }
+        failed = write_section(file, buffer, chunk_bytes, &checksum);
+    }
+
+    // segment bytes start after the table, each one where the one before it ends
+    uint64_t offset = sizeof(struct save_header) + (uint64_t) nodes -> num_chunks * chunk_bytes
+        + (uint64_t) snapshot -> num_segments * sizeof(struct saved_segment);
+    for (uint32_t i = 0; i < snapshot -> num_segments && failed == 0; i++){
+        struct saved_segment saved;
+        memset(&saved, '\0', sizeof(struct saved_segment));
+        saved.index = (*(snapshot -> segments + i)) -> index;
+        saved.capacity = (*(snapshot -> segments + i)) -> capacity;
+        saved.used = *(snapshot -> used + i);
+        saved.offset = offset;
+        offset += (saved.used + 7) / 8 * 8;
+        failed = write_section(file, &saved, sizeof(struct saved_segment), &checksum);
+    }
+    // deletes mark entries dead in the pinned segments while we write, the bytes are copied under
+    // arena_lock so the checksum is of what is written. btree_load works out which entries are live itself.
+    struct value_arena * arena = snapshot -> store -> arena;
+    char * bytes = NULL;
+    uint64_t bytes_capacity = 0;
+    for (uint32_t i = 0; i < snapshot -> num_segments && failed == 0; i++){
+        uint64_t used = *(snapshot -> used + i);
+        uint64_t padded = (used + 7) / 8 * 8;
+        if (padded > bytes_capacity){
+            bytes = (char *) realloc(bytes, padded);
+            bytes_capacity = padded;
+        }
+        memset(bytes + used, '\0', padded - used);
+        pthread_mutex_lock(&arena -> arena_lock);
+        memcpy(bytes, (*(snapshot -> segments + i)) -> base, used);
+        pthread_mutex_unlock(&arena -> arena_lock);
+        failed = write_section(file, bytes, padded, &checksum);
+    }
+    free(bytes);
+
+    header.file_bytes = offset;
+    header.checksum = checksum;
+    header.header_checksum = checksum_bytes(&header, offsetof(struct save_header, header_checksum), 0);
+    if (failed == 0){
+        failed = fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, 1, sizeof(struct save_header), file) != sizeof(struct save_header);
+    }
+    failed = failed || fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed = fclose(file) != 0 || failed;
+    failed = failed || rename(temp_path, path) != 0;
+    if (failed){
+        remove(temp_path);
+    }
+    free(temp_path);
+
+    free(buffer);
+    free(is_free);
+    free(bases);
+    if (own_snapshot){
+        btree_snapshot_release(snapshot);
+    }
+    return failed;
+}
+
+// A store from a file written by btree_save, NULL if it can not be read, was saved by another format
+// version or key width, or does not match its checksums.
+void * btree_load(const char * path){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (uint64_t) file_stat.st_size < sizeof(struct save_header)){
+        close(fd);
+        return NULL;
+    }
+    uint64_t file_bytes = file_stat.st_size;
+    char * file = (char *) mmap(NULL, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED){
+        return NULL;
+    }
+
+    const struct save_header * header = (const struct save_header *) file;
+    uint64_t chunk_bytes = (uint64_t) header -> nodes_per_chunk * header -> node_bytes;
+    const char * chunks = file + sizeof(struct save_header);
+    const struct saved_segment * saved = (const struct saved_segment *) (chunks + header -> num_chunks * chunk_bytes);
+    if (memcmp(header -> magic, SAVE_MAGIC, sizeof(header -> magic)) != 0 || header -> format_version != SAVE_FORMAT_VERSION
+        || header -> key_bits != BTREE_KEY_BITS || header -> file_bytes != file_bytes
+        || header -> header_checksum != checksum_bytes(header, offsetof(struct save_header, header_checksum), 0)
+        || header -> node_bytes != node_size(header -> branching)
+        || header -> checksum != checksum_bytes(chunks, file_bytes - sizeof(struct save_header), 0)){
+        munmap(file, file_bytes);
+        return NULL;
+    }
+
+    struct store_config config = {header -> branching, header -> n_processors, header -> mode, header -> internal_branching,
+        header -> value_mode, header -> filter_bits_per_key, header -> tombstone_deletes, header -> merge_percent};
+    struct store_header * store = (struct store_header *) init_store_with_config(&config);
+    struct node_arena * nodes = store -> nodes;
+    struct value_arena * arena = store -> arena;
+    store -> internal_branching = header -> internal_branching;
+
+    nodes -> chunks = (char **) malloc(sizeof(char *) * (header -> num_chunks + 1));
+    for (uint32_t c = 0; c < header -> num_chunks; c++){
+        *(nodes -> chunks + c) = new_chunk(chunk_bytes);
+        memcpy(*(nodes -> chunks + c), chunks + c * chunk_bytes, chunk_bytes);
+    }
+    nodes -> num_chunks = header -> num_chunks;
+    nodes -> next_unused = header -> next_unused;
+    nodes -> free_list = header -> free_list;
+
+    // sealed, so they are compacted and released like any other, their live bytes are counted again from the tree
+    pthread_mutex_lock(&arena -> arena_lock);
+    for (uint32_t i = 0; i < header -> num_segments; i++){
+        struct segment * segment = map_segment(arena, (saved + i) -> index, (saved + i) -> capacity);
+        memcpy(segment -> base, file + (saved + i) -> offset, (saved + i) -> used);
+        segment -> used = (saved + i) -> used;
+        segment -> sealed = 1;
+        // entries the saved tree does not point at stay dead
+        for (uint64_t offset = 0; offset < segment -> used;){
+            struct arena_entry * entry = (struct arena_entry *) (segment -> base + offset);
+            entry -> length |= DEAD_ENTRY;
+            entry -> handles = 0;
+            offset += entry_size(entry -> length & ~DEAD_ENTRY);
+        }
+    }
+
+    uint8_t * is_free = free_nodes(nodes);
+    uint64_t num_keys = 0;
+    for (uint32_t index = 1; index < nodes -> next_unused; index++){
+        Btree_Node * node = node_at(nodes, index);
+        node_arrays_from_offsets(node);
+        if (*(is_free + index) || node -> keys_info == NULL){
+            continue;
+        }
+        for (uint16_t j = 0; j < node -> num_keys; j++){
+            struct info * slot = node -> keys_info + j;
+            if (is_tombstone(slot) || value_is_inline(slot)){
+                num_keys += is_tombstone(slot) == 0;
+                continue;
+            }
+            struct segment * segment = *(arena -> segments + ((uint64_t) slot -> data >> SAVED_OFFSET_BITS));
+            slot -> data = segment -> base + ((uint64_t) slot -> data & (((uint64_t) 1 << SAVED_OFFSET_BITS) - 1));
+            struct arena_entry * entry = ((struct arena_entry *) slot -> data) - 1;
+            entry -> length &= ~DEAD_ENTRY;
+            segment -> live += entry_size(entry -> length);
+            num_keys += 1;
+        }
+    }
+
+    // the tree is in place before the maintenance thread is woken to compact against it
+    store -> root = node_at(nodes, header -> root);
+    store -> num_nodes = header -> num_nodes;
+    store -> tombstones = header -> tombstones;
+    for (uint32_t i = 0; i < header -> num_segments; i++){
+        struct segment * segment = *(arena -> segments + (saved + i) -> index);
+        if (release_if_empty(arena, segment) == 0 && segment_is_sparse(segment)){
+            pthread_cond_signal(&arena -> wake);
+        }
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+    if (store -> filter != NULL){
+        filter_resize(store -> filter, 2 * num_keys);
+        filter_set_subtree(store -> filter, store -> root, store);
+    }
+    if (store -> tombstones >= TOMBSTONE_BATCH){
+        arena_request_purge(arena);
+    }else if (store -> tombstones != 0){
+        arena_request_idle_purge(arena);
+    }
+
+    free(is_free);
+    munmap(file, file_bytes);
+    return store;
+}
+
+
+
+// ######## Walks over the subtrees of the root ############
+//
+// A walk over the whole tree is split between up to n_processors threads, each one takes a range of
+// children of the root and walks their subtrees, the root itself is left to the caller.
+// The caller holds the tree lock for all of it, the workers only read.
+
+// The number of walks for the tree, one for a tree too small to be worth the threads
+uint16_t subtree_walks_for(void * helper){
+    struct store_header * store = (struct store_header *) helper;
+    if (store -> num_nodes < PARALLEL_WALK_MIN_NODES || store -> n_processors <= 1){
+        return 1;
+    }
+    return store -> n_processors;
+}
+
+// Splits the children of root into up to max_walks ranges of about the same weight, weights has one per child,
+// NULL for the same weight. Returns the number of ranges in walks.
+uint16_t partition_subtrees(Btree_Node * root, const uint64_t * weights, uint16_t max_walks, struct subtree_walk * walks, void * helper){
+    uint16_t num_walks = max_walks;
+    if (num_walks > root -> num_children){
+        num_walks = root -> num_children;
+    }
+    uint64_t total = 0;
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        total += weights == NULL ? 1 : *(weights + i);
+    }
+
+    // a range ends once it reaches its share of what is left, and leaves a child for every later range
+    uint16_t child = 0;
+    uint64_t done = 0;
+    for (uint16_t w = 0; w < num_walks; w++){
+        struct subtree_walk * walk = walks + w;
+        memset(walk, '\0', sizeof(struct subtree_walk));
+        walk -> helper = helper;
+        walk -> root = root;
+        walk -> leaf_depth = -1;
+        walk -> first = child;
+        uint64_t share = (total - done) / (num_walks - w);
+        uint64_t weight = 0;
+        while (child < root -> num_children - (num_walks - w - 1) && (weight < share || child == walk -> first || w == num_walks - 1)){
+            weight += weights == NULL ? 1 : *(weights + child);
+            child += 1;
+        }
+        walk -> last = child;
+        done += weight;
+    }
+    return num_walks;
+}
+
+// Runs work on every walk, one thread each. A single walk runs in the calling thread.
+void run_subtree_walks(void * (*work)(void *), struct subtree_walk * walks, uint16_t num_walks){
+    if (num_walks == 1){
+        work(walks);
+        return;
+    }
+    pthread_t * thread_ID = (pthread_t *) malloc(num_walks * sizeof(pthread_t));
+    for (uint16_t w = 0; w < num_walks; w++){
+        pthread_create(thread_ID + w, NULL, work, (void *) (walks + w));
+    }
+    for (uint16_t w = 0; w < num_walks; w++){
+        pthread_join(*(thread_ID + w), NULL);
+    }
+    free(thread_ID);
+}
+
+// Nodes and live keys under every child of the range, in node_counts and key_counts
+void * count_subtrees_thread(void * argv){
+    struct subtree_walk * walk = (struct subtree_walk *) argv;
+    struct node_arena * nodes = ((struct store_header *) walk -> helper) -> nodes;
+    for (uint16_t i = walk -> first; i < walk -> last; i++){
+        count_subtree(peek_node(nodes, *(walk -> root -> children + i)), walk -> node_counts + i, walk -> key_counts + i, walk -> helper);
+    }
+    return NULL;
+}
+
+// the keys preorder copies, tombstones left out
+void count_subtree(Btree_Node * root, uint64_t * num_nodes, uint64_t * num_keys, void * helper){
+    if (root == NULL){
+        return;
+    }
+    *num_nodes += 1;
+    for (uint16_t j = 0; j < root -> num_keys; j++){
+        if (root -> keys_info == NULL || is_tombstone(root -> keys_info + j) == 0){
+            *num_keys += 1;
+        }
     }
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        count_subtree(peek_node(nodes, *(root -> children + i)), num_nodes, num_keys, helper);
+    }
+}
 
+// The range in preorder from next_node and next_key on, where a walk of the whole tree would put it
+void * preorder_subtrees_thread(void * argv){
+    struct subtree_walk * walk = (struct subtree_walk *) argv;
+    struct node_arena * nodes = ((struct store_header *) walk -> helper) -> nodes;
+    for (uint16_t i = walk -> first; i < walk -> last; i++){
+        preorder(peek_node(nodes, *(walk -> root -> children + i)), walk -> list, &walk -> next_node, &walk -> next_key, walk -> helper);
+    }
+    return NULL;
+}
 
+void * verify_subtrees_thread(void * argv){
+    struct subtree_walk * walk = (struct subtree_walk *) argv;
+    struct node_arena * nodes = ((struct store_header *) walk -> helper) -> nodes;
+    Btree_Node * root = walk -> root;
+    uint16_t last_child = root -> num_children - 1;
+    for (uint16_t i = walk -> first; i < walk -> last && walk -> result == 0; i++){
+        const btree_key_t * low = i == 0 ? NULL : root -> keys + i - 1;
+        const btree_key_t * high = i == last_child ? NULL : root -> keys + i;
+        int edge = (i == 0 ? 1 : 0) | (i == last_child ? 2 : 0);
+        walk -> result = verify_node(peek_node(nodes, *(root -> children + i)), low, high, 1, edge, walk);
+    }
+    return NULL;
 }
 
+// Checks node and its subtree, its keys are above low and below high (NULL for no bound), B+tree keys may
+// equal low. edge: bit 1 on the left edge of the tree, bit 2 on the right one. 0 if it is fine.
+int verify_node(Btree_Node * node, const btree_key_t * low, const btree_key_t * high, uint16_t depth, int edge, struct subtree_walk * walk){
+    struct store_header * store = (struct store_header *) walk -> helper;
+    int bplus = store -> mode == STORE_BPLUS_TREE;
+    if (node == NULL){
+        return 1;
+    }
+    uint16_t fan_out = bplus && node -> num_children != 0 ? store -> internal_branching : store -> branching;
+    if (node -> num_keys > fan_out - 1){
+        return 1;
+    }
+    walk -> num_nodes += depth == 0 ? 0 : 1;
+    if (depth != 0 && edge == 0 && node -> num_keys < merge_watermark(fan_out, store)){
+        return 1;
+    }
+    for (uint16_t i = 0; i < node -> num_keys; i++){
+        btree_key_t key = *(node -> keys + i);
+        if ((i != 0 && *(node -> keys + i - 1) >= key) || (high != NULL && key >= *high)){
+            return 1;
+        }
+        if (low != NULL && (key < *low || (bplus == 0 && key == *low))){
+            return 1;
+        }
+    }
+
+    if (node -> num_children == 0){
+        if (depth != 0 && node -> num_keys == 0){
+            return 1;
+        }
+        if (walk -> leaf_depth == -1){
+            walk -> leaf_depth = depth;
+        }
+        if (walk -> leaf_depth != depth){
+            return 1;
+        }
+        if (bplus){
+            if (walk -> last_leaf == NULL){
+                walk -> first_leaf = node;
+            }else if (walk -> last_leaf -> next_leaf != node -> index || node -> prev_leaf != walk -> last_leaf -> index){
+                return 1;
+            }
+            walk -> last_leaf = node;
+        }
+        return 0;
+    }
+
+    if (node -> num_children != node -> num_keys + 1){
+        return 1;
+    }
+    if (depth == 0){
+        return 0;
+    }
+    for (uint16_t i = 0; i < node -> num_children; i++){
+        const btree_key_t * child_low = i == 0 ? low : node -> keys + i - 1;
+        const btree_key_t * child_high = i == node -> num_keys ? high : node -> keys + i;
+        int child_edge = (edge & 1 && i == 0 ? 1 : 0) | (edge & 2 && i == node -> num_keys ? 2 : 0);
+        if (verify_node(peek_node(store -> nodes, *(node -> children + i)), child_low, child_high, depth + 1, child_edge, walk)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+
+// ######## B+tree mode ############
+//
+// Internal nodes only hold separators: keys[i] is the smallest key that may be found under children[i + 1].
+// They have no keys_info, so the children follow the keys and many more fit in one node block.
+// Leaves hold every key with its key_info and are linked in key order through prev_leaf / next_leaf.
+
+// the most children an internal node of a node block of node_bytes can hold, the keys array
+// has room for one key more than the maximum so a node can overflow before it is split
+uint16_t internal_branching_for(uint32_t node_bytes){
+    uint32_t branching = (node_bytes - NODE_HEADER_BYTES - sizeof(uint32_t)) / (sizeof(btree_key_t) + sizeof(uint32_t));
+    if (branching > UINT16_MAX){
+        branching = UINT16_MAX;
+    }
+    return branching;
+}
+
+Btree_Node* initialize_internal_node(uint16_t internal_branching, uint32_t node_bytes, void *memory_start){
+    Btree_Node * new_node = (Btree_Node *) memory_start;
+    memset(new_node, '\0', node_bytes);
+
+    new_node -> keys = (btree_key_t *) ((char *) new_node + NODE_HEADER_BYTES);
+    new_node -> keys_info = NULL;
+    new_node -> children = (uint32_t *) (new_node -> keys + internal_branching);
+    return new_node;
+}
+
+Btree_Node* allocate_internal_node(void * helper){
+    uint16_t internal_branching = ((struct store_header *) helper) -> internal_branching;
+    uint32_t node_bytes = ((struct store_header *) helper) -> node_bytes;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    uint32_t index = node_arena_alloc(nodes);
+    Btree_Node * new_node = initialize_internal_node(internal_branching, node_bytes, node_at(nodes, index));
+    new_node -> index = index;
+    return new_node;
+}
+
+void add_separator_in_one_node(Btree_Node * node, btree_key_t key){
+    uint16_t position = search_keys(node -> keys, node -> num_keys, key);
+    memmove(node -> keys + position + 1, node -> keys + position, sizeof(btree_key_t) * (node -> num_keys - position));
+    *(node -> keys + position) = key;
+    node -> num_keys += 1;
+}
+
+void delete_separator_in_one_node(Btree_Node * node, uint16_t position){
+    memmove(node -> keys + position, node -> keys + position + 1, sizeof(btree_key_t) * (node -> num_keys - 1 - position));
+    node -> num_keys -= 1;
+}
+
+// Split an overflowing B+tree node, the new right half is returned.
+// For a leaf the separator is a copy of the first key of the right half, which stays in the leaf,
+// for an internal node the middle separator moves up and is removed from both halves.
+// edge is append_edge of node, see split_left_keys
+Btree_Node* split_bplus_node(Btree_Node * node, int edge, btree_key_t * separator, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    int num_keys = node -> num_keys;
+
+    if (node -> keys_info != NULL){
+        Btree_Node * new_right = allocate_node(helper);
+        int left_keys = split_left_keys(num_keys, edge);
+        int right_keys = num_keys - left_keys;
+
+        memcpy(new_right -> keys, node -> keys + left_keys, sizeof(btree_key_t) * right_keys);
+        memcpy(new_right -> keys_info, node -> keys_info + left_keys, sizeof(struct info) * right_keys);
+        new_right -> num_keys = right_keys;
+        node -> num_keys = left_keys;
+        *separator = *(new_right -> keys);
+
+        // link the new leaf just after node
+        new_right -> prev_leaf = node -> index;
+        new_right -> next_leaf = node -> next_leaf;
+        if (node -> next_leaf != NO_NODE){
+            node_at(nodes, node -> next_leaf) -> prev_leaf = new_right -> index;
+        }
+        node -> next_leaf = new_right -> index;
+        return new_right;
+    }
+
+    Btree_Node * new_right = allocate_internal_node(helper);
+    int middle_key_index = split_left_keys(num_keys - 1, edge);
+    int right_keys = num_keys - middle_key_index - 1;
+
+    memcpy(new_right -> keys, node -> keys + middle_key_index + 1, sizeof(btree_key_t) * right_keys);
+    memcpy(new_right -> children, node -> children + middle_key_index + 1, sizeof(uint32_t) * (right_keys + 1));
+    memset(node -> children + middle_key_index + 1, '\0', sizeof(uint32_t) * (right_keys + 1));
+    new_right -> num_keys = right_keys;
+    new_right -> num_children = right_keys + 1;
+    *separator = *(node -> keys + middle_key_index);
+    node -> num_keys = middle_key_index;
+    node -> num_children = middle_key_index + 1;
+    return new_right;
+}
+
+// the child at position of parent is merged away, take it out of the leaf list first
+void unlink_leaf(Btree_Node * parent, uint16_t position, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node * leaf = node_at(nodes, *(parent -> children + position));
+    if (leaf -> prev_leaf != NO_NODE){
+        node_at(nodes, leaf -> prev_leaf) -> next_leaf = leaf -> next_leaf;
+    }
+    if (leaf -> next_leaf != NO_NODE){
+        node_at(nodes, leaf -> next_leaf) -> prev_leaf = leaf -> prev_leaf;
+    }
+}
+
+// Deletes always happen in a leaf, there is nothing to swap. tree lock must be held
+int bplus_delete(btree_key_t key, void * helper){
+    uint16_t branching = ((struct store_header *) helper) -> branching;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+
+    struct descent_path path;
+    if (descend(key, &path, helper) == 0){
+        return 1;
+    }
+    Btree_Node * leaf = path.nodes[path.depth - 1];
+    int num_keys = delete_key_in_one_node(leaf, key, 1, helper);
+
+    // same minimum as the leaves of the B-tree
+    int min_key_num = merge_watermark(branching, helper);
+    if (path.depth == 1 || num_keys >= min_key_num){
+        return 0;
+    }
+
+    Btree_Node * parent = path.nodes[path.depth - 2];
+    uint16_t position = path.slots[path.depth - 1];
+    Btree_Node * left_sibling = NULL;
+    Btree_Node * right_sibling = NULL;
+    if (position > 0){
+        left_sibling = node_at(nodes, *(parent -> children + position - 1));
+    }
+    if (position < parent -> num_keys){
+        right_sibling = node_at(nodes, *(parent -> children + position + 1));
+    }
+
+    if (left_sibling != NULL && left_sibling -> num_keys > min_key_num){
+        // the last key of the left sibling becomes the first key of leaf and its separator
+        btree_key_t largest_key = *(left_sibling -> keys + left_sibling -> num_keys - 1);
+        add_key_in_one_node(leaf, largest_key, left_sibling -> keys_info + left_sibling -> num_keys - 1);
+        delete_key_in_one_node(left_sibling, largest_key, 0, helper);
+        *(parent -> keys + position - 1) = largest_key;
+    }else if (right_sibling != NULL && right_sibling -> num_keys > min_key_num){
+        // the first key of the right sibling moves to leaf, the next one separates them
+        btree_key_t smallest_key = *(right_sibling -> keys);
+        add_key_in_one_node(leaf, smallest_key, right_sibling -> keys_info);
+        delete_key_in_one_node(right_sibling, smallest_key, 0, helper);
+        *(parent -> keys + position) = *(right_sibling -> keys);
+    }else if (left_sibling != NULL){
+        // merge leaf into the left sibling, their separator goes away
+        unlink_leaf(parent, position, helper);
+        merge_two_nodes(parent, position - 1, position, helper);
+        delete_separator_in_one_node(parent, position - 1);
+        balance_bplus_internal(&path, path.depth - 2, left_sibling, helper);
+    }else{
+        unlink_leaf(parent, position + 1, helper);
+        merge_two_nodes(parent, position, position + 1, helper);
+        delete_separator_in_one_node(parent, position);
+        balance_bplus_internal(&path, path.depth - 2, leaf, helper);
+    }
+    return 0;
+}
+
+// internal_node is path->nodes[level], last_child is the child which is left after a merge below it
+void balance_bplus_internal(struct descent_path * path, int level, Btree_Node * last_child, void * helper){
+    uint16_t internal_branching = ((struct store_header *) helper) -> internal_branching;
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    Btree_Node * internal_node = path -> nodes[level];
+    int min_key_num = merge_watermark(internal_branching, helper);
+
+    if (level == 0){
+        // the root only goes away once its last separator did
+        if (internal_node -> num_keys == 0){
+            ((struct store_header *) helper) -> root = last_child;
+            node_arena_free(nodes, internal_node -> index);
+            uint64_t * num_nodes = &((struct store_header *) helper) -> num_nodes;
+            (*num_nodes) -= 1;
+        }
+        return;
+    }
+    if (internal_node -> num_keys >= min_key_num){
+        return;
+    }
+
+    Btree_Node * parent = path -> nodes[level - 1];
+    uint16_t position = path -> slots[level];
+    Btree_Node * left_sibling = NULL;
+    Btree_Node * right_sibling = NULL;
+    if (position > 0){
+        left_sibling = node_at(nodes, *(parent -> children + position - 1));
+    }
+    if (position < parent -> num_keys){
+        right_sibling = node_at(nodes, *(parent -> children + position + 1));
+    }
+
+    if (left_sibling != NULL && left_sibling -> num_keys > min_key_num){
+        // rotate right: the separator comes down, the last separator of the left sibling goes up
+        add_separator_in_one_node(internal_node, *(parent -> keys + position - 1));
+        *(parent -> keys + position - 1) = *(left_sibling -> keys + left_sibling -> num_keys - 1);
+        left_sibling -> num_keys -= 1;
+        move_child(internal_node, *(left_sibling -> children + left_sibling -> num_children - 1), left_sibling, 0);
+    }else if (right_sibling != NULL && right_sibling -> num_keys > min_key_num){
+        // rotate left
+        add_separator_in_one_node(internal_node, *(parent -> keys + position));
+        *(parent -> keys + position) = *(right_sibling -> keys);
+        delete_separator_in_one_node(right_sibling, 0);
+        move_child(internal_node, *(right_sibling -> children), right_sibling, 1);
+    }else if (left_sibling != NULL){
+        // the separator comes down between the keys of both nodes
+        add_separator_in_one_node(left_sibling, *(parent -> keys + position - 1));
+        merge_two_nodes(parent, position - 1, position, helper);
+        delete_separator_in_one_node(parent, position - 1);
+        balance_bplus_internal(path, level - 1, left_sibling, helper);
+    }else{
+        add_separator_in_one_node(internal_node, *(parent -> keys + position));
+        merge_two_nodes(parent, position, position + 1, helper);
+        delete_separator_in_one_node(parent, position);
+        balance_bplus_internal(path, level - 1, internal_node, helper);
+    }
+}
+
+// keys of a B-tree subtree in order, from the first one not smaller than start_key
+void inorder_keys(Btree_Node * root, btree_key_t start_key, btree_key_t * keys, uint64_t max_keys, uint64_t * count, void * helper){
+    struct node_arena * nodes = ((struct store_header *) helper) -> nodes;
+    if (root == NULL || *count == max_keys){
+        return;
+    }
+    // subtrees left of the lower bound only hold smaller keys
+    uint16_t position = search_keys(root -> keys, root -> num_keys, start_key);
+    for (uint16_t i = position; i <= root -> num_keys && *count < max_keys; i++){
+        inorder_keys(peek_node(nodes, *(root -> children + i)), start_key, keys, max_keys, count, helper);
+        if (i < root -> num_keys && *count < max_keys && is_tombstone(root -> keys_info + i) == 0){
+            *(keys + *count) = *(root -> keys + i);
+            *count += 1;
+        }
+    }
+}
+
+
+
+// ######## Membership filter ############
+//
+// A blocked Bloom filter: every key sets FILTER_HASHES bits in one cache line sized block.
+// Deleted keys keep their bits, so once enough keys are deleted, or more keys are added than
+// the filter was sized for, it is rebuilt from the keys in the tree by the next insert or lookup.
+// Everything here runs under the tree lock.
+
+// 64 bits of hash from a key, the finalizer of splitmix64
+uint64_t hash_key(btree_key_t key){
+    uint64_t hash = (uint64_t) key;
+#if BTREE_KEY_BITS == 128
+    hash ^= (uint64_t) (key >> 64) * 0x9E3779B97F4A7C15ULL;
+#endif
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+struct key_filter * filter_create(uint8_t bits_per_key, uint64_t expected_keys){
+    struct key_filter * filter = (struct key_filter *) malloc(sizeof(struct key_filter));
+    memset(filter, '\0', sizeof(struct key_filter));
+    filter -> bits_per_key = bits_per_key;
+    filter_resize(filter, expected_keys);
+    return filter;
+}
+
+void filter_destroy(struct key_filter * filter){
+    if (filter != NULL){
+        free(filter -> blocks);
+        free(filter);
+    }
+}
+
+// drop every key and make room for expected_keys keys
+void filter_resize(struct key_filter * filter, uint64_t expected_keys){
+    if (expected_keys < FILTER_MIN_KEYS){
+        expected_keys = FILTER_MIN_KEYS;
+    }
+    uint64_t block_bits = FILTER_BLOCK_WORDS * 64;
+    filter -> num_blocks = (expected_keys * filter -> bits_per_key + block_bits - 1) / block_bits;
+    filter -> capacity = filter -> num_blocks * block_bits / filter -> bits_per_key;
+    free(filter -> blocks);
+    filter -> blocks = (uint64_t *) aligned_alloc(CACHE_LINE, filter -> num_blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t));
+    memset(filter -> blocks, '\0', filter -> num_blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t));
+    filter -> num_keys = 0;
+    filter -> deleted = 0;
+}
+
+void filter_set(struct key_filter * filter, btree_key_t key){
+    uint64_t hash = hash_key(key);
+    uint64_t * block = filter -> blocks + (hash % filter -> num_blocks) * FILTER_BLOCK_WORDS;
+    // the bits inside the block come from the other end of the hash, 9 bits each
+    for (int i = 0; i < FILTER_HASHES; i++){
+        uint32_t bit = (hash >> (63 - 9 * (i + 1))) & 511;
+        *(block + bit / 64) |= (uint64_t) 1 << (bit % 64);
+    }
+    filter -> num_keys += 1;
+}
+
+int filter_test(struct key_filter * filter, btree_key_t key){
+    uint64_t hash = hash_key(key);
+    uint64_t * block = filter -> blocks + (hash % filter -> num_blocks) * FILTER_BLOCK_WORDS;
+    for (int i = 0; i < FILTER_HASHES; i++){
+        uint32_t bit = (hash >> (63 - 9 * (i + 1))) & 511;
+        if ((*(block + bit / 64) & ((uint64_t) 1 << (bit % 64))) == 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// set the keys of a subtree, separators of B+tree internal nodes are not keys
+void filter_set_subtree(struct key_filter * filter, Btree_Node * root, void * helper){
+    if (root == NULL){
+        return;
+    }
+    if (root -> keys_info != NULL){
+        for (uint16_t i = 0; i < root -> num_keys; i++){
+            if (is_tombstone(root -> keys_info + i) == 0){
+                filter_set(filter, *(root -> keys + i));
+            }
+        }
+    }
+    for (uint16_t i = 0; i < root -> num_children; i++){
+        filter_set_subtree(filter, peek_node(((struct store_header *) helper) -> nodes, *(root -> children + i)), helper);
+    }
+}
+
+// size the filter for twice the keys in the tree and set them again
+void filter_rebuild(void * helper){
+    struct key_filter * filter = ((struct store_header *) helper) -> filter;
+    filter_resize(filter, 2 * (filter -> num_keys - filter -> deleted));
+    filter_set_subtree(filter, ((struct store_header *) helper) -> root, helper);
+    filter -> rebuilds += 1;
+}
+
+// a key was inserted
+void filter_add(btree_key_t key, void * helper){
+    struct key_filter * filter = ((struct store_header *) helper) -> filter;
+    if (filter == NULL){
+        return;
+    }
+    if (filter -> num_keys >= filter -> capacity){
+        // the tree already has the key
+        filter_rebuild(helper);
+        return;
+    }
+    filter_set(filter, key);
+}
+
+// a key was deleted, its bits stay until the next rebuild
+void filter_delete(void * helper){
+    struct key_filter * filter = ((struct store_header *) helper) -> filter;
+    if (filter != NULL){
+        filter -> deleted += 1;
+    }
+}
+
+// 0 if the key is not in the tree, 1 if it may be
+int filter_check(btree_key_t key, void * helper){
+    struct key_filter * filter = ((struct store_header *) helper) -> filter;
+    if (filter == NULL){
+        return 1;
+    }
+    if (filter -> deleted * 100 > filter -> num_keys * FILTER_REBUILD_PERCENT){
+        filter_rebuild(helper);
+    }
+    filter -> lookups += 1;
+    if (filter_test(filter, key) == 0){
+        filter -> negatives += 1;
+        return 0;
+    }
+    return 1;
+}
+
+// filter_check let a missing key through
+void filter_false_positive(void * helper){
+    struct key_filter * filter = ((struct store_header *) helper) -> filter;
+    if (filter != NULL){
+        filter -> false_positives += 1;
+    }
+}
+
+void btree_filter_stats(void * helper, struct filter_stats * stats){
+    memset(stats, '\0', sizeof(struct filter_stats));
+    lock_at_start();
+    struct key_filter * filter = ((struct store_header *) helper) -> filter;
+    if (filter != NULL){
+        stats -> lookups = filter -> lookups;
+        stats -> negatives = filter -> negatives;
+        stats -> false_positives = filter -> false_positives;
+        stats -> rebuilds = filter -> rebuilds;
+        stats -> filter_bytes = filter -> num_blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (stats -> negatives + stats -> false_positives != 0){
+        stats -> false_positive_rate = (double) stats -> false_positives / (stats -> negatives + stats -> false_positives);
+    }
+}
+
+
+
+// ######## In-node key search ############
+//
+// All of them return the number of keys in keys[0, n) which are smaller than key,
+// i.e. the position of key if it exists, or the position it should be inserted.
+// Keys in one node are sorted and unique.
+
+uint16_t linear_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key){
+    uint16_t position = 0;
+    while (position < n && *(keys + position) < key){
+        position++;
+    }
+    return position;
+}
+
+uint16_t binary_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key){
+    uint16_t low = 0;
+    uint16_t high = n;
+    while (low < high){
+        uint16_t middle = low + (high - low) / 2;
+        if (*(keys + middle) < key){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+#ifdef HAVE_AVX2_KEY_SEARCH
+#if BTREE_KEY_BITS == 32
+// AVX2 has only signed compare, flipping the sign bit of both sides keeps the unsigned order
+__attribute__((target("avx2")))
+uint16_t avx2_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key){
+    const __m256i sign = _mm256_set1_epi32((int) 0x80000000);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi32((int) key), sign);
+    uint16_t position = 0;
+
+    // 8 keys per compare, keys are sorted so the mask is a run of ones from the low bit
+    for (; position + 8 <= n; position += 8){
+        __m256i block = _mm256_loadu_si256((const __m256i *) (keys + position));
+        block = _mm256_xor_si256(block, sign);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, block)));
+        if (mask != 0xFF){
+            return position + __builtin_popcount(mask);
+        }
+    }
+    return position + linear_search_keys(keys + position, n - position, key);
+}
+#else
+// the same with 4 keys of 64 bits per compare
+__attribute__((target("avx2")))
+uint16_t avx2_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key){
+    const __m256i sign = _mm256_set1_epi64x((long long) 0x8000000000000000ULL);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x((long long) key), sign);
+    uint16_t position = 0;
+
+    for (; position + 4 <= n; position += 4){
+        __m256i block = _mm256_loadu_si256((const __m256i *) (keys + position));
+        block = _mm256_xor_si256(block, sign);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, block)));
+        if (mask != 0xF){
+            return position + __builtin_popcount(mask);
+        }
+    }
+    return position + linear_search_keys(keys + position, n - position, key);
+}
+#endif
+
+static int avx2_supported(){
+    static int supported = -1;
+    if (supported == -1){
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return supported;
+}
+#endif
+
+uint16_t search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key){
+    if (n <= LINEAR_SEARCH_MAX_KEYS){
+        return linear_search_keys(keys, n, key);
+    }
+
+#ifdef HAVE_AVX2_KEY_SEARCH
+    if (avx2_supported()){
+        // narrow a wide node down to a window which a few AVX2 compares finish
+        uint16_t low = 0;
+        uint16_t high = n;
+        while (high - low > SIMD_SEARCH_MAX_KEYS){
+            uint16_t middle = low + (high - low) / 2;
+            if (*(keys + middle) < key){
+                low = middle + 1;
+            }else{
+                high = middle;
+            }
+        }
+        return low + avx2_search_keys(keys + low, high - low, key);
+    }
+#endif
+
+    return binary_search_keys(keys, n, key);
+}
+
+
+
+// ######## Per-store node arena ############
+
+struct node_arena * node_arena_create(uint32_t node_bytes){
+    struct node_arena * nodes = (struct node_arena *) malloc(sizeof(struct node_arena));
+    memset(nodes, '\0', sizeof(struct node_arena));
+    nodes -> node_bytes = node_bytes;
+    // big nodes still get one node per chunk
+    nodes -> nodes_per_chunk = NODE_CHUNK_SIZE / node_bytes;
+    if (nodes -> nodes_per_chunk == 0){
+        nodes -> nodes_per_chunk = 1;
+    }
+    // index 0 is NO_NODE, it is never handed out
+    nodes -> next_unused = 1;
+    nodes -> free_list = NO_NODE;
+    return nodes;
+}
+
+// the arena of a store or of a snapshot, a chunk is freed with the last list of chunks holding it
+void node_arena_destroy(struct node_arena * nodes){
+    for (uint32_t i = 0; i < nodes -> num_chunks; i++){
+        release_chunk(*(nodes -> chunks + i));
+    }
+    free(nodes -> chunks);
+    free(nodes);
+}
+
+// A chunk is preceded by CHUNK_HEADER bytes holding the number of chunk lists it is in
+char * new_chunk(uint64_t chunk_bytes){
+    char * chunk = (char *) aligned_alloc(CACHE_LINE, CHUNK_HEADER + chunk_bytes) + CHUNK_HEADER;
+    *chunk_refs(chunk) = 1;
+    return chunk;
+}
+
+uint32_t * chunk_refs(char * chunk){
+    return (uint32_t *) (chunk - CHUNK_HEADER);
+}
+
+void release_chunk(char * chunk){
+    *chunk_refs(chunk) -= 1;
+    if (*chunk_refs(chunk) == 0){
+        free(chunk - CHUNK_HEADER);
+    }
+}
+
+// A copy of the list of chunks for a snapshot, every chunk is shared until the store changes it. tree lock held
+struct node_arena * node_arena_share(struct node_arena * nodes){
+    struct node_arena * shared = (struct node_arena *) malloc(sizeof(struct node_arena));
+    memcpy(shared, nodes, sizeof(struct node_arena));
+    shared -> snapshots = 0;
+    shared -> chunks = (char **) malloc(sizeof(char *) * (nodes -> num_chunks + 1));
+    memcpy(shared -> chunks, nodes -> chunks, sizeof(char *) * nodes -> num_chunks);
+    for (uint32_t i = 0; i < nodes -> num_chunks; i++){
+        *chunk_refs(*(nodes -> chunks + i)) += 1;
+    }
+    nodes -> snapshots += 1;
+    return shared;
+}
+
+// Gives the store its own copy of chunk c, the arrays of every node point into the node itself so they
+// are moved along. The snapshots keep the old chunk. tree lock held
+char * unshare_chunk(struct node_arena * nodes, uint32_t c){
+    uint64_t chunk_bytes = (uint64_t) nodes -> nodes_per_chunk * nodes -> node_bytes;
+    char * shared = *(nodes -> chunks + c);
+    char * chunk = new_chunk(chunk_bytes);
+    memcpy(chunk, shared, chunk_bytes);
+
+    for (uint32_t i = 0; i < nodes -> nodes_per_chunk; i++){
+        uint64_t index = (uint64_t) c * nodes -> nodes_per_chunk + i;
+        if (index == NO_NODE || index >= nodes -> next_unused){
+            continue;
+        }
+        Btree_Node * node = (Btree_Node *) (chunk + (uint64_t) i * nodes -> node_bytes);
+        // the offsets in the old node are the ones in its copy
+        node_arrays_to_offsets(node, (Btree_Node *) (shared + (uint64_t) i * nodes -> node_bytes), nodes -> node_bytes);
+        node_arrays_from_offsets(node);
+    }
+    *(nodes -> chunks + c) = chunk;
+    release_chunk(shared);
+    return chunk;
+}
+
+// The arrays of a node are inside its block. These turn the pointers to them into offsets from the start
+// of the block, 0 for NULL, and back, for copies of nodes somewhere else. from is the block the pointers are into.
+void node_arrays_to_offsets(Btree_Node * node, const Btree_Node * from, uint32_t node_bytes){
+    const char * start = (const char *) from;
+    uint64_t offsets[3] = {(uint64_t) ((char *) node -> keys - start), (uint64_t) ((char *) node -> keys_info - start),
+        (uint64_t) ((char *) node -> children - start)};
+    for (int i = 0; i < 3; i++){
+        if (offsets[i] >= node_bytes){
+            offsets[i] = 0;
+        }
+    }
+    node -> keys = (btree_key_t *) offsets[0];
+    node -> keys_info = (struct info *) offsets[1];
+    node -> children = (uint32_t *) offsets[2];
+}
+
+void node_arrays_from_offsets(Btree_Node * node){
+    char * start = (char *) node;
+    node -> keys = node -> keys == NULL ? NULL : (btree_key_t *) (start + (uint64_t) node -> keys);
+    node -> keys_info = node -> keys_info == NULL ? NULL : (struct info *) (start + (uint64_t) node -> keys_info);
+    node -> children = node -> children == NULL ? NULL : (uint32_t *) (start + (uint64_t) node -> children);
+}
+
+// the node of an index, NULL for NO_NODE. The node may be changed: a chunk a snapshot shares is copied first,
+// so the tree lock must be held while a snapshot exists
+Btree_Node * node_at(struct node_arena * nodes, uint32_t index){
+    if (index == NO_NODE){
+        return NULL;
+    }
+    uint32_t c = index / nodes -> nodes_per_chunk;
+    char * chunk = *(nodes -> chunks + c);
+    if (nodes -> snapshots != 0 && *chunk_refs(chunk) > 1){
+        chunk = unshare_chunk(nodes, c);
+    }
+    return (Btree_Node *) (chunk + (uint64_t) (index % nodes -> nodes_per_chunk) * nodes -> node_bytes);
+}
+
+// the node of an index for reading only, NULL for NO_NODE. It may be in a chunk a snapshot shares,
+// so walks over the tree can look at nodes from several threads. On a store the node is only good while
+// the tree lock is held: the next node_at may copy its chunk, and releasing the snapshot frees the old one.
+Btree_Node * peek_node(struct node_arena * nodes, uint32_t index){
+    if (index == NO_NODE){
+        return NULL;
+    }
+    char * chunk = *(nodes -> chunks + index / nodes -> nodes_per_chunk);
+    return (Btree_Node *) (chunk + (uint64_t) (index % nodes -> nodes_per_chunk) * nodes -> node_bytes);
+}
+
+// the index of a free node, from the free list or from the newest chunk. the tree lock must be held
+uint32_t node_arena_alloc(struct node_arena * nodes){
+    if (nodes -> free_list != NO_NODE){
+        uint32_t index = nodes -> free_list;
+        nodes -> free_list = *((uint32_t *) node_at(nodes, index));
+        return index;
+    }
+
+    // with one node per chunk, chunk 0 only holds NO_NODE and the first node needs a second chunk
+    while (nodes -> next_unused >= nodes -> num_chunks * nodes -> nodes_per_chunk){
+        // only the list of chunks is moved, the chunks stay where they are
+        nodes -> chunks = (char **) realloc(nodes -> chunks, sizeof(char *) * (nodes -> num_chunks + 1));
+        *(nodes -> chunks + nodes -> num_chunks) = new_chunk((uint64_t) nodes -> nodes_per_chunk * nodes -> node_bytes);
+        nodes -> num_chunks += 1;
+    }
+
+    uint32_t index = nodes -> next_unused;
+    nodes -> next_unused += 1;
+    return index;
+}
+
+// a freed node is linked into the free list through its first 4 bytes. the tree lock must be held
+void node_arena_free(struct node_arena * nodes, uint32_t index){
+    *((uint32_t *) node_at(nodes, index)) = nodes -> free_list;
+    nodes -> free_list = index;
+}
+
+
+
+// ######## Ciphertext arena ############
+
+struct value_arena * arena_create(void * helper){
+    struct value_arena * arena = (struct value_arena *) malloc(sizeof(struct value_arena));
+    memset(arena, '\0', sizeof(struct value_arena));
+    pthread_mutex_init(&arena -> arena_lock, NULL);
+    pthread_cond_init(&arena -> wake, NULL);
+    arena -> helper = helper;
+    arena -> active = NO_SEGMENT;
+
+    pthread_create(&arena -> maintenance, NULL, &maintenance_thread, (void *) arena);
+    return arena;
+}
+
+void arena_destroy(struct value_arena * arena){
+    pthread_mutex_lock(&arena -> arena_lock);
+    arena -> stop = 1;
+    pthread_cond_signal(&arena -> wake);
+    pthread_mutex_unlock(&arena -> arena_lock);
+    pthread_join(arena -> maintenance, NULL);
+
+    for (uint32_t i = 0; i < arena -> num_segments; i++){
+        struct segment * segment = *(arena -> segments + i);
+        if (segment != NULL){
+            munmap(segment -> base, segment -> capacity);
+            free(segment);
+        }
+    }
+    free(arena -> segments);
+    pthread_cond_destroy(&arena -> wake);
+    pthread_mutex_destroy(&arena -> arena_lock);
+    free(arena);
+}
+
+// map a new segment and give it a free index. arena_lock must be held
+struct segment * new_segment(struct value_arena * arena, uint64_t capacity){
+    uint32_t index = 0;
+    while (index < arena -> num_segments && *(arena -> segments + index) != NULL){
+        index++;
+    }
+    return map_segment(arena, index, capacity);
+}
+
+// map a segment at index, a free one or one past the table. arena_lock must be held
+struct segment * map_segment(struct value_arena * arena, uint32_t index, uint64_t capacity){
+    if (index >= arena -> num_segments){
+        arena -> segments = (struct segment **) realloc(arena -> segments, sizeof(struct segment *) * (index + 1));
+        memset(arena -> segments + arena -> num_segments, '\0', sizeof(struct segment *) * (index + 1 - arena -> num_segments));
+        arena -> num_segments = index + 1;
+    }
+
+    struct segment * segment = (struct segment *) malloc(sizeof(struct segment));
+    memset(segment, '\0', sizeof(struct segment));
+    segment -> index = index;
+    segment -> capacity = capacity;
+    segment -> base = (char *) mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    *(arena -> segments + index) = segment;
+    return segment;
+}
+
+// give a segment back to the OS. arena_lock must be held
+void release_segment(struct value_arena * arena, struct segment * segment){
+    arena -> reclaimed_bytes += segment -> capacity;
+    *(arena -> segments + segment -> index) = NULL;
+    munmap(segment -> base, segment -> capacity);
+    free(segment);
+}
+
+// a sealed segment which nobody needs any more is released, returns 1 if it was
+int release_if_empty(struct value_arena * arena, struct segment * segment){
+    if (segment -> sealed == 1 && segment -> live == 0 && segment -> held == 0
+        && segment -> pins == 0 && segment -> snapshots == 0){
+        release_segment(arena, segment);
+        return 1;
+    }
+    return 0;
+}
+
+// a sealed segment is worth compacting when most of it is dead, one only held by handles has nothing to move
+int segment_is_sparse(struct segment * segment){
+    return segment -> sealed == 1 && segment -> pins == 0 && segment -> snapshots == 0
+        && (segment -> live != 0 || segment -> held == 0)
+        && segment -> live * 100 < segment -> used * COMPACT_LIVE_PERCENT;
+}
+
+// bytes one entry takes in its segment, the next head stays aligned for its key
+uint64_t entry_size(uint64_t length){
+    uint64_t align = _Alignof(struct arena_entry);
+    return (sizeof(struct arena_entry) + length + align - 1) / align * align;
+}
+
+// reserve space for one ciphertext, arena_lock must be held
+void * append_entry(struct value_arena * arena, btree_key_t key, uint64_t length){
+    uint64_t entry_bytes = entry_size(length);
+    struct segment * segment;
+
+    if (entry_bytes > SEGMENT_SIZE / 4){
+        // a big value gets a segment of its own, nothing else is appended to it
+        uint64_t page = 4096;
+        segment = new_segment(arena, (entry_bytes + page - 1) / page * page);
+        segment -> sealed = 1;
+    }else{
+        if (arena -> active == NO_SEGMENT || 
+            (*(arena -> segments + arena -> active)) -> used + entry_bytes > SEGMENT_SIZE){
+            if (arena -> active != NO_SEGMENT){
+                struct segment * full = *(arena -> segments + arena -> active);
+                full -> sealed = 1;
+                if (release_if_empty(arena, full) == 0 && segment_is_sparse(full)){
+                    pthread_cond_signal(&arena -> wake);
+                }
+            }
+            arena -> active = new_segment(arena, SEGMENT_SIZE) -> index;
+        }
+        segment = *(arena -> segments + arena -> active);
+    }
+
+    struct arena_entry * entry = (struct arena_entry *) (segment -> base + segment -> used);
+    entry -> key = key;
+    entry -> segment = segment -> index;
+    entry -> handles = 0;
+    entry -> length = length;
+    segment -> used += entry_bytes;
+    segment -> live += entry_bytes;
+    return entry + 1;
+}
+
+void * arena_append(struct value_arena * arena, btree_key_t key, uint64_t length){
+    pthread_mutex_lock(&arena -> arena_lock);
+    void * data = append_entry(arena, key, length);
+    (*(arena -> segments + ((struct arena_entry *) data - 1) -> segment)) -> pins += 1;
+    pthread_mutex_unlock(&arena -> arena_lock);
+    return data;
+}
+
+// wake the maintenance thread to remove tombstones
+void arena_request_purge(struct value_arena * arena){
+    pthread_mutex_lock(&arena -> arena_lock);
+    if (arena -> purge == 0){
+        arena -> purge = 1;
+        pthread_cond_signal(&arena -> wake);
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+}
+
+// have the maintenance thread remove tombstones once the store is quiet, see purge_when_idle
+void arena_request_idle_purge(struct value_arena * arena){
+    pthread_mutex_lock(&arena -> arena_lock);
+    if (arena -> idle_purge == 0){
+        arena -> idle_purge = 1;
+        pthread_cond_signal(&arena -> wake);
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+}
+
+// Called by the maintenance thread every PURGE_IDLE_MS while tombstones wait, arena_lock held.
+// Removes them if the store had no inserts or deletes since the last call and no snapshot shares
+// its nodes, which purging would copy. Returns 1 if it purged.
+int purge_when_idle(struct value_arena * arena){
+    struct store_header * store = (struct store_header *) arena -> helper;
+
+    // cleared first so a tombstone added meanwhile asks again, the tree lock comes before the arena lock
+    arena -> idle_purge = 0;
+    pthread_mutex_unlock(&arena -> arena_lock);
+    lock_at_start();
+    uint64_t writes = store -> inserts + store -> deletes;
+    uint64_t tombstones = store -> tombstones;
+    uint32_t snapshots = store -> nodes -> snapshots;
+    pthread_mutex_unlock(&lock);
+
+    int purge = tombstones != 0 && writes == arena -> idle_writes && snapshots == 0;
+    arena -> idle_writes = writes;
+    if (purge){
+        btree_purge(store);
+    }
+    pthread_mutex_lock(&arena -> arena_lock);
+    if (tombstones != 0 && purge == 0){
+        arena -> idle_purge = 1;
+    }
+    return purge;
+}
+
+// the entry of arena_append is in the tree now
+void arena_unpin(struct value_arena * arena, void * data){
+    struct arena_entry * entry = ((struct arena_entry *) data) - 1;
+    pthread_mutex_lock(&arena -> arena_lock);
+    struct segment * segment = *(arena -> segments + entry -> segment);
+    segment -> pins -= 1;
+    recheck_segment(arena, segment);
+    pthread_mutex_unlock(&arena -> arena_lock);
+}
+
+// a value handle reads the entry, the tree lock is held so the entry is still the slot's
+void arena_hold(struct value_arena * arena, void * data){
+    struct arena_entry * entry = ((struct arena_entry *) data) - 1;
+    pthread_mutex_lock(&arena -> arena_lock);
+    entry -> handles += 1;
+    pthread_mutex_unlock(&arena -> arena_lock);
+}
+
+// the last handle of a dead entry gives its bytes back to the segment
+void arena_let_go(struct value_arena * arena, void * data){
+    struct arena_entry * entry = ((struct arena_entry *) data) - 1;
+    pthread_mutex_lock(&arena -> arena_lock);
+    entry -> handles -= 1;
+    if (entry -> handles == 0 && (entry -> length & DEAD_ENTRY) != 0){
+        struct segment * segment = *(arena -> segments + entry -> segment);
+        segment -> held -= entry_size(entry -> length & ~DEAD_ENTRY);
+        recheck_segment(arena, segment);
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+}
+
+// length bytes fit the entry, no handle reads it and no snapshot its segment, so it can be rewritten in place.
+// the entry keeps its length, the slot has the size of the value. tree lock held
+int arena_rewritable(struct value_arena * arena, void * data, uint64_t length){
+    struct arena_entry * entry = ((struct arena_entry *) data) - 1;
+    pthread_mutex_lock(&arena -> arena_lock);
+    int rewritable = length <= entry -> length && entry -> handles == 0
+        && (*(arena -> segments + entry -> segment)) -> snapshots == 0;
+    pthread_mutex_unlock(&arena -> arena_lock);
+    return rewritable;
+}
+
+// after a pin, snapshot or handle let go of the segment, arena_lock must be held
+void recheck_segment(struct value_arena * arena, struct segment * segment){
+    if (release_if_empty(arena, segment) == 0 && segment_is_sparse(segment)){
+        pthread_cond_signal(&arena -> wake);
+    }
+}
+
+// Pins every segment for a snapshot, returns them, their number in count and the bytes used in each in used
+struct segment ** arena_pin_all(struct value_arena * arena, uint32_t * count, uint64_t ** used){
+    pthread_mutex_lock(&arena -> arena_lock);
+    struct segment ** pinned = (struct segment **) malloc(sizeof(struct segment *) * (arena -> num_segments + 1));
+    *used = (uint64_t *) malloc(sizeof(uint64_t) * (arena -> num_segments + 1));
+    *count = 0;
+    for (uint32_t i = 0; i < arena -> num_segments; i++){
+        struct segment * segment = *(arena -> segments + i);
+        if (segment != NULL){
+            segment -> snapshots += 1;
+            *(pinned + *count) = segment;
+            *(*used + *count) = segment -> used;
+            *count += 1;
+        }
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+    return pinned;
+}
+
+void arena_unpin_all(struct value_arena * arena, struct segment ** pinned, uint32_t count){
+    pthread_mutex_lock(&arena -> arena_lock);
+    for (uint32_t i = 0; i < count; i++){
+        (*(pinned + i)) -> snapshots -= 1;
+        recheck_segment(arena, *(pinned + i));
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+    free(pinned);
+}
+
+void arena_free(struct value_arena * arena, void * data){
+    struct arena_entry * entry = ((struct arena_entry *) data) - 1;
+    pthread_mutex_lock(&arena -> arena_lock);
+    struct segment * segment = *(arena -> segments + entry -> segment);
+    segment -> live -= entry_size(entry -> length);
+    if (entry -> handles != 0){
+        segment -> held += entry_size(entry -> length);
+    }
+    entry -> length |= DEAD_ENTRY;
+    recheck_segment(arena, segment);
+    pthread_mutex_unlock(&arena -> arena_lock);
+}
+
+// Move the live entries of every sparse segment to the active segment and release the sparse ones.
+// Returns the number of bytes given back to the OS.
+uint64_t btree_compact(void * helper){
+    struct value_arena * arena = ((struct store_header *) helper) -> arena;
+    // the arena is the store's, a snapshot only pins it
+    if (((struct store_header *) helper) -> read_only){
+        return 0;
+    }
+
+    // the tree lock first, the slots of moved entries are rewritten
+    lock_at_start();
+    pthread_mutex_lock(&arena -> arena_lock);
+    uint64_t reclaimed_before = arena -> reclaimed_bytes;
+
+    // a sparse active segment is sealed too, its live entries move to a new one
+    if (arena -> active != NO_SEGMENT){
+        struct segment * active = *(arena -> segments + arena -> active);
+        if (active -> pins == 0 && active -> snapshots == 0 && active -> live * 100 < active -> used * COMPACT_LIVE_PERCENT){
+            active -> sealed = 1;
+            arena -> active = NO_SEGMENT;
+        }
+    }
+
+    for (uint32_t i = 0; i < arena -> num_segments; i++){
+        struct segment * segment = *(arena -> segments + i);
+        if (segment == NULL || segment_is_sparse(segment) == 0){
+            continue;
+        }
+
+        uint64_t offset = 0;
+        while (offset < segment -> used){
+            struct arena_entry * entry = (struct arena_entry *) (segment -> base + offset);
+            uint64_t length = entry -> length & ~DEAD_ENTRY;
+            offset += entry_size(length);
+            if ((entry -> length & DEAD_ENTRY) != 0){
+                continue;
+            }
+
+            // an unpinned live entry is always the data of the slot of its key, the path to a slot
+            // is only copied away from a snapshot when the slot is rewritten
+            struct info * key_info = peek_key_info(entry -> key, helper);
+            if (key_info != NULL && value_is_inline(key_info) == 0 && key_info -> data == (void *) (entry + 1)){
+                // a value btree_update copied over a longer one moves at its own size
+                key_info = find_key_info(entry -> key, helper);
+                uint64_t bytes = count_blocks(key_info -> size) * BYTES_ONE_BLOCK;
+                void * moved = append_entry(arena, entry -> key, bytes);
+                memcpy(moved, entry + 1, bytes);
+                key_info -> data = moved;
+                arena -> relocated_bytes += bytes;
+            }
+            // a handle goes on reading the old copy, the segment waits for it
+            if (entry -> handles != 0){
+                segment -> held += entry_size(length);
+            }
+            entry -> length |= DEAD_ENTRY;
+        }
+
+        segment -> live = 0;
+        release_if_empty(arena, segment);
+        arena -> compactions += 1;
+    }
+
+    uint64_t reclaimed = arena -> reclaimed_bytes - reclaimed_before;
+    pthread_mutex_unlock(&arena -> arena_lock);
+    pthread_mutex_unlock(&lock);
+    return reclaimed;
+}
+
+void btree_arena_stats(void * helper, struct arena_stats * stats){
+    struct value_arena * arena = ((struct store_header *) helper) -> arena;
+    memset(stats, '\0', sizeof(struct arena_stats));
+
+    pthread_mutex_lock(&arena -> arena_lock);
+    for (uint32_t i = 0; i < arena -> num_segments; i++){
+        struct segment * segment = *(arena -> segments + i);
+        if (segment == NULL){
+            continue;
+        }
+        stats -> num_segments += 1;
+        stats -> segment_bytes += segment -> capacity;
+        stats -> live_bytes += segment -> live;
+        stats -> dead_bytes += segment -> used - segment -> live;
+    }
+    stats -> relocated_bytes = arena -> relocated_bytes;
+    stats -> reclaimed_bytes = arena -> reclaimed_bytes;
+    stats -> compactions = arena -> compactions;
+    pthread_mutex_unlock(&arena -> arena_lock);
+
+    if (stats -> live_bytes + stats -> dead_bytes != 0){
+        stats -> fragmentation = (double) stats -> dead_bytes / (stats -> live_bytes + stats -> dead_bytes);
+    }
+}
+
+// One per store: sleeps until a segment gets sparse, then compacts. Tombstones are removed in batches
+// as they come and, when fewer are left, once the store has been quiet for PURGE_IDLE_MS.
+void * maintenance_thread(void * argv){
+    struct value_arena * arena = (struct value_arena *) argv;
+
+    pthread_mutex_lock(&arena -> arena_lock);
+    while (arena -> stop == 0){
+        if (arena -> purge){
+            // like compaction, removing tombstones takes the tree lock first
+            arena -> purge = 0;
+            pthread_mutex_unlock(&arena -> arena_lock);
+            btree_purge(arena -> helper);
+            pthread_mutex_lock(&arena -> arena_lock);
+            continue;
+        }
+
+        int sparse = 0;
+        for (uint32_t i = 0; i < arena -> num_segments; i++){
+            struct segment * segment = *(arena -> segments + i);
+            if (segment != NULL && segment_is_sparse(segment)){
+                sparse = 1;
+                break;
+            }
+        }
+
+        if (sparse == 0 && arena -> idle_purge){
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += (long) PURGE_IDLE_MS * 1000000;
+            until.tv_sec += until.tv_nsec / 1000000000;
+            until.tv_nsec %= 1000000000;
+            if (pthread_cond_timedwait(&arena -> wake, &arena -> arena_lock, &until) == ETIMEDOUT){
+                purge_when_idle(arena);
+            }
+            continue;
+        }
+        if (sparse == 0){
+            pthread_cond_wait(&arena -> wake, &arena -> arena_lock);
+            continue;
+        }
+
+        // btree_compact takes the tree lock before the arena lock
+        pthread_mutex_unlock(&arena -> arena_lock);
+        btree_compact(arena -> helper);
+        pthread_mutex_lock(&arena -> arena_lock);
+    }
+    pthread_mutex_unlock(&arena -> arena_lock);
+    return NULL;
+}
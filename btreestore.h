@@ -12,45 +12,373 @@
 #define MAXIMUM_BLOCKS 25000
 #define two_power_32 0x100000000
 #define ADDRESS 8
+#define CACHE_LINE 64
+
+// Node arena: nodes are addressed by their index, index 0 is no node
+#define NO_NODE 0
+#define NODE_CHUNK_SIZE (64 * 1024)
+// in front of every chunk, the number of lists of chunks it is in, see btree_snapshot
+#define CHUNK_HEADER CACHE_LINE
+// no tree with 32 bit node indices and at least 2 children per node is deeper than this
+#define MAX_TREE_DEPTH 64
+
+// Arena: ciphertexts are appended to segments of this size, bigger values get their own segment
+#define SEGMENT_SIZE (256 * 1024)
+// a sealed segment with less live bytes than this percent of its used bytes is compacted
+#define COMPACT_LIVE_PERCENT 50
+#define DEAD_ENTRY 0x8000000000000000
+#define NO_SEGMENT 0xFFFFFFFF
+
+// Tombstone deletes: the top bit of struct info.size marks a deleted key whose value is freed
+#define TOMBSTONE 0x8000000000000000
+// tombstones removed per hold of the tree lock, the maintenance thread is woken at this many
+#define TOMBSTONE_BATCH 256
+// fewer tombstones are removed once the store had no inserts or deletes for this long
+#define PURGE_IDLE_MS 100
+
+// Width of the keys, chosen at compile time: -DBTREE_KEY_BITS=32 (default), 64 or 128.
+// The library and its users must be built with the same width.
+#ifndef BTREE_KEY_BITS
+#define BTREE_KEY_BITS 32
+#endif
+
+#if BTREE_KEY_BITS == 32
+typedef uint32_t btree_key_t;
+#elif BTREE_KEY_BITS == 64
+typedef uint64_t btree_key_t;
+#elif BTREE_KEY_BITS == 128
+typedef unsigned __int128 btree_key_t;
+#else
+#error "BTREE_KEY_BITS must be 32, 64 or 128"
+#endif
+
+// 32 and 64 bit keys have an AVX2 in-node search, 128 bit keys are compared by the scalar searches
+#if (defined(__x86_64__) || defined(__i386__)) && BTREE_KEY_BITS != 128
+#define HAVE_AVX2_KEY_SEARCH 1
+#endif
+
+// store_config.mode
+#define STORE_BTREE 0
+#define STORE_BPLUS_TREE 1
+
+// store_config.value_mode
+#define STORE_ENCRYPTED 0
+#define STORE_PLAINTEXT 1           // values are stored as they are, the key and nonce are not used
+
+// search_keys: up to this many keys a plain scan is the fastest
+#define LINEAR_SEARCH_MAX_KEYS 16
+// search_keys: binary search stops once the window has at most this many keys left for AVX2
+#define SIMD_SEARCH_MAX_KEYS 64
+
+// splitNode: a node split by an append at the right or left edge of the tree keeps this percent
+// of its keys on the side no more keys will come to
+#define APPEND_SPLIT_PERCENT 90
+
+
+// Membership filter: a blocked Bloom filter, every key sets FILTER_HASHES bits in one 64 byte block
+#define FILTER_BLOCK_WORDS 8
+#define FILTER_HASHES 6
+#define FILTER_MIN_KEYS 1024
+// rebuilt once the deleted keys are more than this percent of the keys set in it
+#define FILTER_REBUILD_PERCENT 25
 
+// Walks over the whole tree split the subtrees of the root between threads from this many nodes
+#define PARALLEL_WALK_MIN_NODES 4096
+
+// Values of at most INLINE_VALUE_BYTES keep their ciphertext in the slot itself
+#define INLINE_BLOCKS 2
+#define INLINE_VALUE_BYTES (INLINE_BLOCKS * BYTES_ONE_BLOCK)
 
 struct info {
-    uint32_t size;
+    uint64_t size;
     uint32_t key[4];
     uint64_t nonce;
-    void * data;
+    union {
+        void * data;                            // ciphertext in the arena, when size > INLINE_VALUE_BYTES
+        uint64_t inline_data[INLINE_BLOCKS];    // the ciphertext itself, when size <= INLINE_VALUE_BYTES
+    };
+};
+
+// Returned by btree_acquire, the copy of the slot of a key and a hold on its ciphertext
+struct value_handle {
+    struct info info;
+    void * helper;                  // the store, NULL once released
 };
 
 struct node {
     uint16_t num_keys;
-    uint32_t * keys;
+    btree_key_t * keys;
 };
 
+// Orders of btree_export_stream and the size of the pages it copies for the callback
+#define EXPORT_PREORDER 0
+#define EXPORT_LEVEL_ORDER 1
+#define EXPORT_KEY_ORDER 2
+#define EXPORT_PAGE_NODES 64
+#define EXPORT_PAGE_KEYS 1024
+
+// Gets a node, or a page of keys in key order, and its depth. Non-zero stops the export.
+typedef int (*export_callback)(const struct node * node, uint16_t depth, void * context);
+
 // Branching is b
 // ⌈b/2⌉ ≤ n ≤ b for internal since leaf has no children, n is number of children 
 //      for root, it is a leaf, it obeys n ≤ b. If it is not a leaf, it obeys 2 ≤ n ≤ b 
 // every node has n - 1 keys
 
+// One node is a single block of node_size(branching) bytes, the three arrays are inside it after the header
+
 struct Btree_Node {
     uint16_t num_children;
     uint16_t num_keys;
-    uint32_t * keys;                // one key is corresponds to one node_info
-    struct info ** keys_info;       // *key_info is an array of pointers, each pointer ponits to a strcut info
-    struct Btree_Node ** children;  // *children is an array of pointers, each poniter ponits to a Btree_Node 
-    struct Btree_Node * parent;
-
+    uint32_t index;                 // index of this node in the node arena of the store
+    btree_key_t * keys;             // one key is corresponds to one node_info
+    struct info * keys_info;        // *key_info is an array of struct info, one for each key, stored in the node
+    uint32_t * children;            // *children is an array of node indices, NO_NODE in a leaf
+    uint32_t prev_leaf;             // B+tree leaves only, neighbours in key order
+    uint32_t next_leaf;
 };
 
 typedef struct Btree_Node Btree_Node;
 
+struct node_arena;
+
+// node_at for nodes that are changed, peek_node for nodes that are only read
+typedef Btree_Node * (*node_lookup)(struct node_arena * nodes, uint32_t index);
+
+// keys start after the header, aligned for btree_key_t
+#define NODE_HEADER_BYTES ((sizeof(Btree_Node) + sizeof(btree_key_t) - 1) / sizeof(btree_key_t) * sizeof(btree_key_t))
+
+
+struct store_config {
+    uint16_t branching;
+    uint8_t n_processors;
+    uint8_t mode;                   // STORE_BTREE or STORE_BPLUS_TREE
+    uint16_t internal_branching;    // B+tree only, at least 3, 0 fills the node block with separators
+    uint8_t value_mode;             // STORE_ENCRYPTED or STORE_PLAINTEXT
+    uint8_t filter_bits_per_key;    // bits of the membership filter per key, 0 for no filter
+    uint8_t tombstone_deletes;      // 1: btree_delete leaves a tombstone, the maintenance thread removes it
+    uint8_t merge_percent;          // nodes merge below this percent of their fan-out, 0 for ⌈b/2⌉ - 1 keys
+};
+
+struct node_arena {
+    uint32_t node_bytes;
+    uint32_t nodes_per_chunk;
+    uint32_t num_chunks;
+    uint32_t next_unused;           // first index never handed out
+    uint32_t free_list;             // freed nodes, linked through their first 4 bytes
+    uint32_t snapshots;             // snapshots sharing chunks with this list, see node_at
+    char ** chunks;                 // chunks only move when a snapshot shares them, only this list does
+};
+
+// The nodes from the root down to the node an insert or delete works on, nodes[0] is the root.
+// slots[i] is the position of nodes[i] in the children of nodes[i - 1]
+struct descent_path {
+    uint16_t depth;
+    uint16_t slots[MAX_TREE_DEPTH];
+    Btree_Node * nodes[MAX_TREE_DEPTH];
+};
+
+// One thread's share of a walk over the whole tree: the subtrees under children first to last - 1 of the root
+struct subtree_walk {
+    void * helper;
+    Btree_Node * root;
+    uint16_t first;
+    uint16_t last;
+    uint64_t * node_counts;         // counting, nodes and live keys under each child of the root
+    uint64_t * key_counts;
+    struct node * list;             // export, where the range goes in the list and its keys
+    uint64_t next_node;
+    btree_key_t * next_key;
+    int result;                     // verify, 0 while the range is fine
+    int leaf_depth;
+    uint64_t num_nodes;
+    Btree_Node * first_leaf;        // B+tree, the ends of the leaf list of the range
+    Btree_Node * last_leaf;
+};
+
+
+// The head of one ciphertext in a segment, the ciphertext follows it
+struct arena_entry {
+    btree_key_t key;                // compaction finds the slot pointing at the entry through the key
+    uint32_t segment;               // index of the segment, so freeing an entry finds its segment
+    uint32_t handles;               // value handles reading it, it is not rewritten and its bytes not reused
+    uint64_t length;                // bytes of ciphertext, the top bit marks a dead entry
+};
+
+struct segment {
+    char * base;                    // mmap'd, so releasing it returns the memory to the OS
+    uint64_t capacity;
+    uint64_t used;                  // bytes appended, heads included
+    uint64_t live;                  // bytes of entries not dead, heads included
+    uint64_t held;                  // bytes of dead entries a value handle still reads, the segment can not go
+    uint32_t pins;                  // entries not in the tree yet, the segment can not move or go
+    uint32_t snapshots;             // snapshots reading it, nothing in it is moved or rewritten
+    uint32_t index;
+    uint8_t sealed;                 // nothing will be appended any more
+};
+
+struct value_arena {
+    pthread_mutex_t arena_lock;     // protects segments and counters, taken after the tree lock
+    struct segment ** segments;     // released segments leave NULL
+    uint32_t num_segments;
+    uint32_t active;                // index of the segment small values are appended to
+    uint64_t relocated_bytes;
+    uint64_t reclaimed_bytes;
+    uint64_t compactions;
+
+    pthread_t maintenance;
+    pthread_cond_t wake;            // signalled when a segment gets sparse
+    int stop;
+    int purge;                      // tombstones are waiting to be removed
+    int idle_purge;                 // fewer than TOMBSTONE_BATCH are, they go once the store is quiet
+    uint64_t idle_writes;           // inserts and deletes of the store when the thread last looked
+    void * helper;
+};
+
+struct key_filter {
+    uint64_t * blocks;              // num_blocks blocks of FILTER_BLOCK_WORDS words, cache line aligned
+    uint64_t num_blocks;
+    uint64_t capacity;              // keys it is sized for at bits_per_key
+    uint64_t num_keys;              // keys set since the last rebuild
+    uint64_t deleted;               // keys deleted since the last rebuild, their bits are still set
+    uint64_t lookups;
+    uint64_t negatives;             // lookups answered by the filter alone
+    uint64_t false_positives;       // lookups the filter let through for a missing key
+    uint64_t rebuilds;
+    uint8_t bits_per_key;
+};
+
+// The store handle returned by init_store, every function gets it back as helper
+struct store_header {
+    Btree_Node * root;
+    struct node_arena * nodes;
+    struct value_arena * arena;
+    struct key_filter * filter;     // NULL without store_config.filter_bits_per_key
+    uint64_t num_nodes;
+    uint64_t id;                    // unique per store in the process, fingers name their store by it
+    uint64_t structure_version;     // bumped by every split and delete, drops the fingers on the store
+    uint64_t finger_hits;           // inserts and lookups that started at the leaf of a finger
+    uint64_t append_splits;         // splits at an edge of appends, see split_left_keys
+    uint64_t tombstones;            // keys deleted but still in the tree
+    uint64_t inserts;               // keys inserted and deleted, for splits and merges per operation
+    uint64_t deletes;
+    uint64_t splits;
+    uint64_t merges;
+    uint32_t node_bytes;            // node_size(branching), every node block has this size
+    uint16_t branching;
+    uint16_t internal_branching;    // B+tree internal nodes
+    uint8_t n_processors;
+    uint8_t mode;                   // STORE_BTREE or STORE_BPLUS_TREE
+    uint8_t value_mode;             // STORE_ENCRYPTED or STORE_PLAINTEXT
+    uint8_t tombstone_deletes;
+    uint8_t merge_percent;
+    uint8_t read_only;              // a snapshot, see btree_snapshot
+};
+
+// Returned by btree_snapshot, used like a store
+struct store_snapshot {
+    struct store_header view;       // first, so the snapshot is a store header
+    struct store_header * store;
+    struct segment ** segments;     // value segments pinned by the snapshot
+    uint64_t * used;                // bytes used in each of them when it was taken, btree_save writes these
+    uint32_t num_segments;
+};
+
+// Files of btree_save, see btree_load
+#define SAVE_MAGIC "BTSTORE"
+#define SAVE_FORMAT_VERSION 1
+// a saved info.data is the segment index above these bits and the offset in the segment below
+#define SAVED_OFFSET_BITS 40
+
+struct save_header {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t key_bits;              // BTREE_KEY_BITS of the library that saved it
+    uint32_t node_bytes;
+    uint32_t nodes_per_chunk;
+    uint32_t num_chunks;
+    uint32_t next_unused;
+    uint32_t free_list;
+    uint32_t root;                  // index of the root, NO_NODE for an empty tree
+    uint32_t num_segments;
+    uint16_t branching;
+    uint16_t internal_branching;
+    uint8_t n_processors;
+    uint8_t mode;
+    uint8_t value_mode;
+    uint8_t tombstone_deletes;
+    uint8_t merge_percent;
+    uint8_t filter_bits_per_key;
+    uint8_t padding[2];
+    uint64_t num_nodes;
+    uint64_t tombstones;
+    uint64_t file_bytes;
+    uint64_t checksum;              // of everything after the header
+    uint64_t header_checksum;       // of the header up to here
+};
+
+struct saved_segment {
+    uint32_t index;
+    uint32_t padding;
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t offset;                // of its bytes in the file
+};
+
+// The last leaf a thread inserted into, the path to it and the range of keys only it can hold
+struct finger {
+    uint64_t store_id;
+    uint64_t version;               // structure_version of the store when the path was taken
+    btree_key_t low;                // keys are above low, or not below it in a B+tree
+    btree_key_t high;               // keys are below high
+    uint8_t has_low;                // 0 for the leftmost leaf
+    uint8_t has_high;               // 0 for the rightmost leaf
+    struct descent_path path;
+};
+
+struct arena_stats {
+    uint64_t num_segments;
+    uint64_t segment_bytes;         // mapped bytes
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    double fragmentation;           // dead bytes / (live bytes + dead bytes)
+    uint64_t relocated_bytes;       // moved by compaction
+    uint64_t reclaimed_bytes;       // given back to the OS
+    uint64_t compactions;           // segments compacted
+};
+
+struct tree_stats {
+    uint64_t num_nodes;
+    uint64_t num_leaves;
+    uint64_t num_keys;              // separators of a B+tree included
+    uint64_t leaf_keys;
+    double fill_factor;             // keys / keys all nodes can hold
+    double leaf_fill_factor;        // leaf keys / keys all leaves can hold
+    uint64_t append_splits;
+    uint64_t tombstones;
+    uint64_t inserts;
+    uint64_t deletes;
+    uint64_t splits;
+    uint64_t merges;
+};
+
+struct filter_stats {
+    uint64_t lookups;
+    uint64_t negatives;
+    uint64_t false_positives;
+    double false_positive_rate;     // false positives / lookups of missing keys
+    uint64_t rebuilds;
+    uint64_t filter_bytes;
+};
+
 
 typedef struct encrypt_or_decrypt_info {
     uint64_t * plain;
     uint32_t key[4];
     uint64_t nonce;
     uint64_t * cipher;
-    uint32_t start_block_index;
-    uint32_t end_block_index;
+    uint64_t start_block_index;
+    uint64_t end_block_index;
 }INFO;
 
 
@@ -58,76 +386,314 @@ typedef struct encrypt_or_decrypt_info {
 
 void * init_store(uint16_t branching, uint8_t n_processors);
 
+void * init_store_with_config(const struct store_config * config);
+
 void close_store(void * helper);
 
-int btree_insert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
+int btree_insert(btree_key_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
+
+int btree_update(btree_key_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
+
+int btree_upsert(btree_key_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
+
+int btree_retrieve(btree_key_t key, struct info * found, void * helper);
+
+int btree_decrypt(btree_key_t key, void * output, void * helper);
+
+int btree_acquire(btree_key_t key, struct value_handle * handle, void * helper);
 
-int btree_retrieve(uint32_t key, struct info * found, void * helper);
+void btree_release(struct value_handle * handle);
 
-int btree_decrypt(uint32_t key, void * output, void * helper);
+const void * btree_handle_data(const struct value_handle * handle);
 
-int btree_delete(uint32_t key, void * helper);
+void btree_decrypt_handle(const struct value_handle * handle, void * output);
+
+int btree_delete(btree_key_t key, void * helper);
+
+uint64_t btree_purge(void * helper);
 
 uint64_t btree_export(void * helper, struct node ** list);
 
+int btree_export_stream(void * helper, uint8_t order, export_callback callback, void * context);
+
+int btree_verify(void * helper);
+
+void * btree_snapshot(void * helper);
+
+void btree_snapshot_release(void * snapshot);
+
+int btree_save(const char * path, void * helper);
+
+void * btree_load(const char * path);
+
+uint64_t btree_scan(btree_key_t start_key, btree_key_t * keys, uint64_t max_keys, void * helper);
+
+uint64_t btree_compact(void * helper);
+
+void btree_arena_stats(void * helper, struct arena_stats * stats);
+
+void btree_filter_stats(void * helper, struct filter_stats * stats);
+
+void btree_tree_stats(void * helper, struct tree_stats * stats);
+
 void encrypt_tea(uint32_t plain[2], uint32_t cipher[2], uint32_t key[4]);
 
 void decrypt_tea(uint32_t cipher[2], uint32_t plain[2], uint32_t key[4]);
 
-void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks);
+void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint64_t num_blocks);
 
-void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint32_t num_blocks);
+void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint64_t num_blocks);
 
 
 // ######## Some helpful functions ############
 void lock_at_start();
 
-void free_one_node(Btree_Node ** node);
+void lock_for_reading(void * helper);
+
+void unlock_for_reading(void * helper);
+
+uint64_t count_blocks(uint64_t count);
+
+uint64_t * update_buffer(uint64_t num_blocks);
 
-void free_all(Btree_Node* root);
+void seal_value(uint64_t * cipher, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
 
-int find_position_of_child(Btree_Node* parent, Btree_Node* child, uint16_t* p);
+void free_key_data(struct info * key_info, void * helper);
 
-int find_position_of_key(Btree_Node* node, uint32_t key, uint16_t* p);
+int value_is_inline(const struct info * key_info);
+
+int is_tombstone(const struct info * key_info);
+
+int tombstone_key(btree_key_t key, void * helper);
+
+int remove_key(btree_key_t key, void * helper);
+
+void collect_tombstones(Btree_Node * root, btree_key_t * keys, uint64_t * count, void * helper);
+
+void free_one_node(Btree_Node ** node, void * helper);
+
+int find_position_of_key(Btree_Node* node, btree_key_t key, uint16_t* p);
 
 int find_position_of_key_info(Btree_Node* node, struct info* key_info, uint16_t* p);
 
+uint32_t node_size(uint16_t branching);
+
+uint32_t keys_bytes(uint16_t branching);
+
 Btree_Node* initialize_Btree_node(uint16_t branching, void *memory_start);
 
-void delete_one_node(Btree_Node **node, void * helper);
+Btree_Node* allocate_node(void * helper);
+
+void delete_one_node(Btree_Node * parent, uint16_t position, void * helper);
+
+int descend(btree_key_t key, struct descent_path * path, void * helper);
 
-Btree_Node * find_insert_node(uint32_t key, Btree_Node * root);
+int peek_descend(btree_key_t key, struct descent_path * path, void * helper);
 
-int add_key_in_one_node(Btree_Node * node, uint32_t key, struct info* key_info_ptr);
+int descend_through(btree_key_t key, struct descent_path * path, node_lookup lookup, void * helper);
 
-int delete_key_in_one_node(Btree_Node * node, uint32_t key, int free_key_info);
+void finger_remember(struct descent_path * path, void * helper);
+
+int finger_hit(btree_key_t key, void * helper);
+
+int finger_descend(btree_key_t key, struct descent_path * path, void * helper);
+
+int add_key_in_one_node(Btree_Node * node, btree_key_t key, struct info* key_info_ptr);
+
+int delete_key_in_one_node(Btree_Node * node, btree_key_t key, int free_removed, void * helper);
 
 int need_split(Btree_Node* node, uint16_t branching);
 
-void add_children(Btree_Node * left_child, Btree_Node * right_child, Btree_Node * original_child, Btree_Node * parent);
+void add_children(Btree_Node * parent, uint16_t position, uint32_t right_child);
+
+int merge_watermark(uint16_t fan_out, void * helper);
+
+int append_edge(struct descent_path * path, int level, btree_key_t key);
+
+int split_left_keys(int to_split, int edge);
+
+void splitNode(struct descent_path * path, uint16_t branching, btree_key_t key, void *helper);
+
+Btree_Node* recursive_find(btree_key_t target_key, struct info * found, void * helper);
+
+struct info * find_key_info(btree_key_t target_key, void * helper);
+
+struct info * peek_key_info(btree_key_t target_key, void * helper);
+
+struct info * key_info_through(btree_key_t target_key, node_lookup lookup, void * helper);
+
+void find_maximum_node(Btree_Node* root, uint16_t root_slot, struct descent_path * path, btree_key_t* maximum_key, void * helper);
+
+void swap_key(btree_key_t key1, Btree_Node* node1, btree_key_t key2, Btree_Node* node2);
+
+void replace_key(Btree_Node* node_replaced, btree_key_t key_replaced, Btree_Node* node, btree_key_t key);
+
+void merge_two_nodes(Btree_Node* parent, uint16_t target_position, uint16_t merged_position, void *helper);
+
+void move_child(Btree_Node * dest_node, uint32_t child, Btree_Node * original_node, int leftmost_or_rightmost);
+
+void balance_internal(struct descent_path * path, int level, int min_key_num, Btree_Node* last_child, void* helper);
+
+void tree_stats_subtree(Btree_Node * root, struct tree_stats * stats, void * helper);
+
+uint16_t copy_live_keys(Btree_Node * node, btree_key_t * keys);
+
+int descend_leftmost(struct descent_path * path, uint16_t depth, void * helper);
+
+int next_in_order(struct descent_path * path, uint8_t order, void * helper);
 
-void splitNode(Btree_Node* node, uint16_t branching, void *helper);
+void preorder(Btree_Node * root, struct node * list, uint64_t * next_node, btree_key_t ** next_key, void * helper);
 
-Btree_Node* recursive_find(uint32_t target_key, struct info * found, Btree_Node * root);
+uint16_t subtree_walks_for(void * helper);
 
-void find_maximum_node(Btree_Node* root, Btree_Node** res, uint32_t* maximum_key);
+uint16_t partition_subtrees(Btree_Node * root, const uint64_t * weights, uint16_t max_walks, struct subtree_walk * walks, void * helper);
 
-void swap_key(uint32_t key1, Btree_Node* node1, uint32_t key2, Btree_Node* node2);
+void run_subtree_walks(void * (*work)(void *), struct subtree_walk * walks, uint16_t num_walks);
 
-void replace_key(Btree_Node* node_replaced, uint32_t key_replaced, Btree_Node* node, u_int32_t key);
+void * count_subtrees_thread(void * argv);
 
-void merge_two_nodes(Btree_Node* target, Btree_Node* node_be_merged, void *helper);
+void count_subtree(Btree_Node * root, uint64_t * num_nodes, uint64_t * num_keys, void * helper);
 
-void move_child(Btree_Node * dest_node, Btree_Node *child, Btree_Node * original_node, int leftmost_or_rightmost);
+void * preorder_subtrees_thread(void * argv);
 
-void balance_internal(Btree_Node *internal_node, int min_key_num, Btree_Node* last_child, void* helper);
+void * verify_subtrees_thread(void * argv);
 
-void preorder(Btree_Node * root, struct node *list, int num_nodes);
+int verify_node(Btree_Node * node, const btree_key_t * low, const btree_key_t * high, uint16_t depth, int edge, struct subtree_walk * walk);
 
 void * thread_encrypt_tea_ctr(void * argv);
 
 void * thread_decrypt_tea_ctr(void * argv);
 
+uint16_t internal_branching_for(uint32_t node_bytes);
+
+Btree_Node* initialize_internal_node(uint16_t internal_branching, uint32_t node_bytes, void *memory_start);
+
+Btree_Node* allocate_internal_node(void * helper);
+
+void add_separator_in_one_node(Btree_Node * node, btree_key_t key);
+
+void delete_separator_in_one_node(Btree_Node * node, uint16_t position);
+
+Btree_Node* split_bplus_node(Btree_Node * node, int edge, btree_key_t * separator, void * helper);
+
+void unlink_leaf(Btree_Node * parent, uint16_t position, void * helper);
+
+int bplus_delete(btree_key_t key, void * helper);
+
+void balance_bplus_internal(struct descent_path * path, int level, Btree_Node * last_child, void * helper);
+
+void inorder_keys(Btree_Node * root, btree_key_t start_key, btree_key_t * keys, uint64_t max_keys, uint64_t * count, void * helper);
+
+uint16_t search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key);
+
+uint16_t linear_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key);
+
+uint16_t binary_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key);
+
+#ifdef HAVE_AVX2_KEY_SEARCH
+uint16_t avx2_search_keys(const btree_key_t * keys, uint16_t n, btree_key_t key);
+#endif
+
+uint64_t hash_key(btree_key_t key);
+
+struct key_filter * filter_create(uint8_t bits_per_key, uint64_t expected_keys);
+
+void filter_destroy(struct key_filter * filter);
+
+void filter_resize(struct key_filter * filter, uint64_t expected_keys);
+
+void filter_set(struct key_filter * filter, btree_key_t key);
+
+int filter_test(struct key_filter * filter, btree_key_t key);
+
+void filter_set_subtree(struct key_filter * filter, Btree_Node * root, void * helper);
+
+void filter_rebuild(void * helper);
+
+void filter_add(btree_key_t key, void * helper);
+
+void filter_delete(void * helper);
+
+int filter_check(btree_key_t key, void * helper);
+
+void filter_false_positive(void * helper);
+
+struct node_arena * node_arena_create(uint32_t node_bytes);
+
+void node_arena_destroy(struct node_arena * nodes);
+
+Btree_Node * node_at(struct node_arena * nodes, uint32_t index);
+
+Btree_Node * peek_node(struct node_arena * nodes, uint32_t index);
+
+char * new_chunk(uint64_t chunk_bytes);
+
+uint32_t * chunk_refs(char * chunk);
+
+void release_chunk(char * chunk);
+
+struct node_arena * node_arena_share(struct node_arena * nodes);
+
+char * unshare_chunk(struct node_arena * nodes, uint32_t c);
+
+void node_arrays_to_offsets(Btree_Node * node, const Btree_Node * from, uint32_t node_bytes);
+
+void node_arrays_from_offsets(Btree_Node * node);
+
+uint64_t checksum_bytes(const void * data, uint64_t length, uint64_t sum);
+
+uint8_t * free_nodes(struct node_arena * nodes);
+
+int write_section(FILE * file, const void * data, uint64_t length, uint64_t * checksum);
+
+uint32_t node_arena_alloc(struct node_arena * nodes);
+
+void node_arena_free(struct node_arena * nodes, uint32_t index);
+
+struct value_arena * arena_create(void * helper);
+
+void arena_destroy(struct value_arena * arena);
+
+struct segment * new_segment(struct value_arena * arena, uint64_t capacity);
+
+struct segment * map_segment(struct value_arena * arena, uint32_t index, uint64_t capacity);
+
+void release_segment(struct value_arena * arena, struct segment * segment);
+
+int release_if_empty(struct value_arena * arena, struct segment * segment);
+
+int segment_is_sparse(struct segment * segment);
+
+uint64_t entry_size(uint64_t length);
+
+void * append_entry(struct value_arena * arena, btree_key_t key, uint64_t length);
+
+void * arena_append(struct value_arena * arena, btree_key_t key, uint64_t length);
+
+void arena_request_purge(struct value_arena * arena);
+
+void arena_request_idle_purge(struct value_arena * arena);
+
+int purge_when_idle(struct value_arena * arena);
+
+void arena_unpin(struct value_arena * arena, void * data);
+
+void arena_hold(struct value_arena * arena, void * data);
+
+void arena_let_go(struct value_arena * arena, void * data);
+
+int arena_rewritable(struct value_arena * arena, void * data, uint64_t length);
+
+void recheck_segment(struct value_arena * arena, struct segment * segment);
+
+struct segment ** arena_pin_all(struct value_arena * arena, uint32_t * count, uint64_t ** used);
+
+void arena_unpin_all(struct value_arena * arena, struct segment ** pinned, uint32_t count);
+
+void arena_free(struct value_arena * arena, void * data);
+
+void * maintenance_thread(void * argv);
+
 
 
 
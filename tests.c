@@ -7,7 +7,10 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <stddef.h>
+#include <malloc.h>
 
 
 #include "btreestore.h"
@@ -153,7 +156,6 @@ void export_info(void * helper, char* test_num){
             for (int j = 0; j < (list + i) -> num_keys; j++){
                 printf("%d ", *((list + i) -> keys + j));
             }
-            free((list + i) -> keys);
             printf("\n");
         }
         free(list);
@@ -353,6 +355,1191 @@ static void multithreaded_combination_huge(void **state){
     }
 }
 
+// Every search strategy must agree with the linear scan for all node sizes
+static void search_keys_agree(void **state){
+    // the keys cross the sign bit of the key width, where a signed compare goes wrong
+    btree_key_t base = ((btree_key_t) 1 << (BTREE_KEY_BITS - 1)) - 0x100;
+    btree_key_t keys[1024];
+    for (int i = 0; i < 1024; i++){
+        keys[i] = base + i * 2;
+    }
+
+    for (int n = 0; n < 1024; n += 7){
+        for (int i = 0; i < 1024 * 2 + 2; i += 3){
+            btree_key_t key = base + i - 1;
+            uint16_t expected = linear_search_keys(keys, n, key);
+            assert_int_equal(binary_search_keys(keys, n, key), expected);
+            assert_int_equal(search_keys(keys, n, key), expected);
+#ifdef HAVE_AVX2_KEY_SEARCH
+            if (__builtin_cpu_supports("avx2")){
+                assert_int_equal(avx2_search_keys(keys, n, key), expected);
+            }
+#endif
+        }
+    }
+}
+
+// Wide nodes go through the binary and SIMD search paths
+static void wide_node_insert_retrieve_delete(void **state){
+    void * helper = init_store(256, 4);
+    for (int i = 0; i < 3000; i++){
+        btree_insert((i * 37) % 3000, "a", 2, encrypt_key, nonce, helper);
+    }
+    struct info found;
+    for (int i = 0; i < 3000; i++){
+        assert_int_equal(btree_retrieve(i, &found, helper), 0);
+    }
+    for (int i = 0; i < 3000; i += 2){
+        assert_int_equal(btree_delete(i, helper), 0);
+    }
+    for (int i = 0; i < 3000; i++){
+        assert_int_equal(btree_retrieve(i, &found, helper), i % 2 == 0);
+    }
+    close_store(helper);
+}
+
+// Random inserts and deletes must keep every key retrievable, this covers borrowing and merging internal nodes
+static void random_insert_delete(void **state){
+    char present[300] = {0};
+    struct info found;
+    srand(2017);
+    for (int op = 0; op < 20000; op++){
+        int key = rand() % 300;
+        if (rand() % 2 == 0){
+            assert_int_equal(btree_insert(key, "a", 2, encrypt_key, nonce, *state), present[key]);
+            present[key] = 1;
+        }else{
+            assert_int_equal(btree_delete(key, *state), !present[key]);
+            present[key] = 0;
+        }
+    }
+    for (int key = 0; key < 300; key++){
+        assert_int_equal(btree_retrieve(key, &found, *state), !present[key]);
+    }
+}
+
+// Freed node indices are handed out again, nodes keep their address while the arena grows,
+// values of every size survive a round trip through the arena
+static void node_arena_indices(void **state){
+    struct node_arena * nodes = node_arena_create(node_size(4));
+    uint32_t first = node_arena_alloc(nodes);
+    assert_int_not_equal(first, NO_NODE);
+    Btree_Node * node = node_at(nodes, first);
+    assert_int_equal((uintptr_t) node % CACHE_LINE, 0);
+    for (uint32_t i = 0; i < 3 * nodes -> nodes_per_chunk; i++){
+        node_arena_alloc(nodes);
+    }
+    assert_ptr_equal(node_at(nodes, first), node);
+    node_arena_free(nodes, first);
+    assert_int_equal(node_arena_alloc(nodes), first);
+    assert_null(node_at(nodes, NO_NODE));
+    node_arena_destroy(nodes);
+
+    char data[1000];
+    char output[1000];
+    for (int i = 0; i < 1000; i++){
+        data[i] = i % 128;
+    }
+    for (int i = 1; i < 1000; i += 37){
+        btree_insert(i, data, i, encrypt_key, nonce, *state);
+    }
+    for (int i = 1; i < 1000; i += 37){
+        assert_int_equal(btree_decrypt(i, output, *state), 0);
+        assert_memory_equal(output, data, i);
+    }
+}
+
+// Deleting most values leaves sparse segments, compaction moves the rest and unmaps them
+static void arena_compaction(void **state){
+    char data[1000];
+    char output[1000];
+    struct arena_stats stats;
+    for (int i = 0; i < 1000; i++){
+        data[i] = (i * 7) % 128;
+    }
+    // about 800 KiB, several segments
+    for (int i = 0; i < 800; i++){
+        assert_int_equal(btree_insert(i, data, 1000, encrypt_key, nonce, *state), 0);
+    }
+    for (int i = 0; i < 800; i++){
+        if (i % 10 != 0){
+            assert_int_equal(btree_delete(i, *state), 0);
+        }
+    }
+    btree_compact(*state);
+
+    btree_arena_stats(*state, &stats);
+    assert_true(stats.reclaimed_bytes > 0);
+    assert_true(stats.compactions > 0);
+    assert_true(stats.fragmentation < 0.5);
+    for (int i = 0; i < 800; i += 10){
+        assert_int_equal(btree_decrypt(i, output, *state), 0);
+        assert_memory_equal(output, data, 1000);
+    }
+    assert_int_equal(btree_decrypt(1, output, *state), 1);
+}
+
+// Values of one or two blocks are kept in the slot, nothing is appended to the arena
+static void inline_small_values(void **state){
+    char data[] = "abcdefghijklmnopq";
+    char output[17];
+    struct arena_stats stats;
+    struct info found;
+    for (int i = 0; i < 200; i++){
+        assert_int_equal(btree_insert(i, data, 1 + i % INLINE_VALUE_BYTES, encrypt_key, nonce, *state), 0);
+    }
+    btree_arena_stats(*state, &stats);
+    assert_int_equal(stats.num_segments, 0);
+
+    for (int i = 0; i < 200; i++){
+        assert_int_equal(btree_retrieve(i, &found, *state), 0);
+        assert_true(value_is_inline(&found));
+        assert_int_equal(btree_decrypt(i, output, *state), 0);
+        assert_memory_equal(output, data, 1 + i % INLINE_VALUE_BYTES);
+    }
+
+    // one byte more goes to the arena
+    assert_int_equal(btree_insert(1000, data, INLINE_VALUE_BYTES + 1, encrypt_key, nonce, *state), 0);
+    btree_arena_stats(*state, &stats);
+    assert_int_equal(stats.num_segments, 1);
+    assert_int_equal(btree_decrypt(1000, output, *state), 0);
+    assert_memory_equal(output, data, INLINE_VALUE_BYTES + 1);
+    for (int i = 0; i < 200; i += 2){
+        assert_int_equal(btree_delete(i, *state), 0);
+    }
+}
+
+// Keys that differ only in their highest bits are kept apart and in order, whatever BTREE_KEY_BITS is
+static void keys_use_full_width(void **state){
+    btree_key_t keys[256];
+    char output[8];
+
+    for (int i = 255; i >= 0; i--){
+        btree_key_t key = ((btree_key_t) i << (BTREE_KEY_BITS - 8)) | 1;
+        assert_int_equal(btree_insert(key, "abcdefg", 8, encrypt_key, nonce, *state), 0);
+    }
+    assert_int_equal(btree_scan(0, keys, 256, *state), 256);
+    for (int i = 0; i < 256; i++){
+        assert_true(keys[i] == (((btree_key_t) i << (BTREE_KEY_BITS - 8)) | 1));
+        assert_int_equal(btree_decrypt(keys[i], output, *state), 0);
+        assert_string_equal(output, "abcdefg");
+    }
+    assert_int_equal(btree_delete((btree_key_t) 255 << (BTREE_KEY_BITS - 8), *state), 1);
+    assert_int_equal(btree_delete(((btree_key_t) 255 << (BTREE_KEY_BITS - 8)) | 1, *state), 0);
+}
+
+// A plaintext store keeps the values as they are and ignores the encryption key
+static void plaintext_values(void **state){
+    struct store_config config = {4, 4, STORE_BTREE, 0, STORE_PLAINTEXT};
+    void * plain = init_store_with_config(&config);
+    char data[100];
+    char output[100];
+    struct info found;
+    for (int i = 0; i < 100; i++){
+        data[i] = i;
+    }
+
+    for (int i = 0; i < 100; i++){
+        assert_int_equal(btree_insert(i, data, i + 1, NULL, 0, plain), 0);
+    }
+    for (int i = 0; i < 100; i += 3){
+        assert_int_equal(btree_delete(i, plain), 0);
+    }
+    for (int i = 0; i < 100; i++){
+        if (i % 3 == 0){
+            assert_int_equal(btree_decrypt(i, output, plain), 1);
+            continue;
+        }
+        assert_int_equal(btree_retrieve(i, &found, plain), 0);
+        assert_int_equal(found.nonce, 0);
+        if (value_is_inline(&found)){
+            assert_memory_equal(found.inline_data, data, i + 1);
+        }else{
+            assert_memory_equal(found.data, data, i + 1);
+        }
+        assert_int_equal(btree_decrypt(i, output, plain), 0);
+        assert_memory_equal(output, data, i + 1);
+    }
+    close_store(plain);
+}
+
+// Updates change only the slot of the key, a ciphertext of the same size is rewritten where it is
+static void update_and_upsert(void **state){
+    char data[100];
+    char output[100];
+    struct info found;
+    struct arena_stats before;
+    struct arena_stats after;
+    for (int i = 0; i < 100; i++){
+        data[i] = 'a' + i % 26;
+    }
+
+    for (int i = 0; i < 300; i++){
+        assert_int_equal(btree_insert(i, data, 40, encrypt_key, nonce, *state), 0);
+    }
+    uint64_t num_nodes = ((struct store_header *) *state) -> num_nodes;
+    assert_int_equal(btree_update(300, data, 40, encrypt_key, nonce, *state), 1);
+
+    assert_int_equal(btree_retrieve(7, &found, *state), 0);
+    void * data_before = found.data;
+    btree_arena_stats(*state, &before);
+    assert_int_equal(btree_update(7, data + 1, 37, encrypt_key, nonce + 1, *state), 0);
+    btree_arena_stats(*state, &after);
+    assert_int_equal(btree_retrieve(7, &found, *state), 0);
+    assert_ptr_equal(found.data, data_before);
+    assert_int_equal(found.nonce, nonce + 1);
+    assert_int_equal(after.live_bytes + after.dead_bytes, before.live_bytes + before.dead_bytes);
+    assert_int_equal(btree_decrypt(7, output, *state), 0);
+    assert_memory_equal(output, data + 1, 37);
+
+    // to an inline value, to a bigger one and back to the first size
+    assert_int_equal(btree_update(8, data, 5, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_decrypt(8, output, *state), 0);
+    assert_memory_equal(output, data, 5);
+    assert_int_equal(btree_update(8, data, 100, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_decrypt(8, output, *state), 0);
+    assert_memory_equal(output, data, 100);
+    assert_int_equal(btree_update(8, data + 3, 40, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_decrypt(8, output, *state), 0);
+    assert_memory_equal(output, data + 3, 40);
+
+    assert_int_equal(btree_upsert(9, data + 2, 40, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_decrypt(9, output, *state), 0);
+    assert_memory_equal(output, data + 2, 40);
+    assert_int_equal(((struct store_header *) *state) -> num_nodes, num_nodes);
+
+    assert_int_equal(btree_upsert(1000, data, 40, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_decrypt(1000, output, *state), 0);
+    assert_memory_equal(output, data, 40);
+}
+
+// A handle keeps its ciphertext readable after the key is deleted, updated or compacted away
+static void value_handles(void **state){
+    char data[1000];
+    char output[1000];
+    struct value_handle handle;
+    struct arena_stats stats;
+    for (int i = 0; i < 1000; i++){
+        data[i] = (i * 13) % 128;
+    }
+
+    assert_int_equal(btree_acquire(1, &handle, *state), 1);
+    for (int i = 0; i < 800; i++){
+        assert_int_equal(btree_insert(i, data, 1000, encrypt_key, nonce, *state), 0);
+    }
+    assert_int_equal(btree_acquire(5, &handle, *state), 0);
+    const void * ciphertext = btree_handle_data(&handle);
+
+    // the same size would be rewritten in place, not while the handle may read it
+    assert_int_equal(btree_update(5, data + 1, 999, encrypt_key, nonce, *state), 0);
+    for (int i = 0; i < 800; i++){
+        assert_int_equal(btree_delete(i, *state), 0);
+    }
+    btree_compact(*state);
+
+    assert_ptr_equal(btree_handle_data(&handle), ciphertext);
+    btree_decrypt_handle(&handle, output);
+    assert_memory_equal(output, data, 1000);
+    btree_release(&handle);
+
+    // the last pin gone, the empty segment is unmapped
+    btree_compact(*state);
+    btree_arena_stats(*state, &stats);
+    assert_int_equal(stats.live_bytes, 0);
+    assert_int_equal(stats.num_segments, 0);
+
+    assert_int_equal(btree_insert(3, "abc", 4, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_acquire(3, &handle, *state), 0);
+    btree_decrypt_handle(&handle, output);
+    assert_string_equal(output, "abc");
+    btree_release(&handle);
+}
+
+// An update that fits the arena entry of the old value is copied over it, the arena does not grow
+static void update_reuses_entry(void **state){
+    char data[1050];
+    char output[1001];
+    struct info before;
+    struct info after;
+    struct arena_stats stats;
+    for (int i = 0; i < 1050; i++){
+        data[i] = (i * 7) % 128;
+    }
+
+    for (int i = 0; i < 100; i++){
+        assert_int_equal(btree_insert(i, data, 1000, encrypt_key, nonce, *state), 0);
+    }
+    assert_int_equal(btree_retrieve(1, &before, *state), 0);
+    assert_int_equal(btree_update(1, data + 1, 500, encrypt_key, nonce + 1, *state), 0);
+    assert_int_equal(btree_retrieve(1, &after, *state), 0);
+    assert_ptr_equal(after.data, before.data);
+    assert_int_equal(btree_decrypt(1, output, *state), 0);
+    assert_memory_equal(output, data + 1, 500);
+
+    assert_int_equal(btree_update(1, data, 1000, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_retrieve(1, &after, *state), 0);
+    assert_ptr_equal(after.data, before.data);
+    assert_int_equal(btree_update(1, data, 1001, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_retrieve(1, &after, *state), 0);
+    assert_ptr_not_equal(after.data, before.data);
+    assert_int_equal(btree_decrypt(1, output, *state), 0);
+    assert_memory_equal(output, data, 1001);
+
+    btree_arena_stats(*state, &stats);
+    uint64_t used = stats.live_bytes + stats.dead_bytes;
+    for (int round = 0; round < 50; round++){
+        for (int i = 2; i < 100; i++){
+            assert_int_equal(btree_update(i, data + round, 100 + (i * round) % 900, encrypt_key, nonce, *state), 0);
+        }
+    }
+    btree_arena_stats(*state, &stats);
+    assert_int_equal(stats.live_bytes + stats.dead_bytes, used);
+    for (int i = 2; i < 100; i++){
+        assert_int_equal(btree_decrypt(i, output, *state), 0);
+        assert_memory_equal(output, data + 49, 100 + (i * 49) % 900);
+    }
+}
+
+// A handle holds only its own entry: the rest of its segment is updated in place and compacted away
+static void handle_holds_only_its_entry(void **state){
+    char data[1000];
+    char output[1000];
+    struct value_handle handle;
+    struct arena_stats stats;
+    struct info before;
+    struct info after;
+    for (int i = 0; i < 1000; i++){
+        data[i] = (i * 13) % 128;
+    }
+
+    for (int i = 0; i < 800; i++){
+        assert_int_equal(btree_insert(i, data, 1000, encrypt_key, nonce, *state), 0);
+    }
+    assert_int_equal(btree_acquire(5, &handle, *state), 0);
+    const void * ciphertext = btree_handle_data(&handle);
+
+    // the neighbour in the same segment is still rewritten in place
+    assert_int_equal(btree_retrieve(6, &before, *state), 0);
+    assert_int_equal(btree_update(6, data + 1, 999, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_retrieve(6, &after, *state), 0);
+    assert_ptr_equal(after.data, before.data);
+
+    // the held key moves with the others, the handle keeps reading the old copy
+    for (int i = 0; i < 800; i++){
+        if (i != 5){
+            assert_int_equal(btree_delete(i, *state), 0);
+        }
+    }
+    btree_compact(*state);
+    assert_int_equal(btree_retrieve(5, &after, *state), 0);
+    assert_ptr_not_equal(after.data, ciphertext);
+    btree_decrypt_handle(&handle, output);
+    assert_memory_equal(output, data, 1000);
+    btree_arena_stats(*state, &stats);
+    assert_int_equal(stats.num_segments, 2);
+
+    // the old segment goes with the handle
+    btree_release(&handle);
+    btree_arena_stats(*state, &stats);
+    assert_int_equal(stats.num_segments, 1);
+    assert_int_equal(btree_decrypt(5, output, *state), 0);
+    assert_memory_equal(output, data, 1000);
+}
+
+// The filter answers most misses alone, never hides a key, and is rebuilt after growth and deletes
+static void membership_filter(void **state){
+    struct store_config config = {16, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 10};
+    void * filtered = init_store_with_config(&config);
+    struct filter_stats stats;
+    struct info found;
+
+    for (int i = 0; i < 10000; i += 2){
+        assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, filtered), 0);
+    }
+    btree_filter_stats(filtered, &stats);
+    assert_true(stats.rebuilds > 0);
+
+    for (int i = 0; i < 10000; i++){
+        assert_int_equal(btree_retrieve(i, &found, filtered), i % 2);
+    }
+    btree_filter_stats(filtered, &stats);
+    assert_int_equal(stats.lookups, 10000);
+    assert_int_equal(stats.negatives + stats.false_positives, 5000);
+    assert_true(stats.false_positive_rate < 0.05);
+
+    uint64_t rebuilds = stats.rebuilds;
+    for (int i = 0; i < 8000; i += 2){
+        assert_int_equal(btree_delete(i, filtered), 0);
+    }
+    for (int i = 0; i < 10000; i += 2){
+        assert_int_equal(btree_retrieve(i, &found, filtered), i < 8000);
+    }
+    btree_filter_stats(filtered, &stats);
+    assert_true(stats.rebuilds > rebuilds);
+    close_store(filtered);
+
+    // without a filter nothing is counted
+    btree_filter_stats(*state, &stats);
+    assert_int_equal(stats.lookups, 0);
+}
+
+// Ascending inserts start at the last leaf, lookups in its range too, deletes and splits drop the finger
+static void finger_for_sequential_inserts(void **state){
+    struct store_config config = {64, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 0};
+    struct store_config bplus_config = {64, 4, STORE_BPLUS_TREE, 0, STORE_ENCRYPTED, 0};
+    void * stores[2] = {init_store_with_config(&config), init_store_with_config(&bplus_config)};
+    struct info found;
+    char output[4];
+
+    for (int s = 0; s < 2; s++){
+        void * store = stores[s];
+        for (int i = 0; i < 10000; i++){
+            assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, store), 0);
+        }
+        // only the insert after a split of the last leaf descends from the root
+        assert_true(((struct store_header *) store) -> finger_hits > 9000);
+
+        assert_int_equal(btree_insert(9999, "abc", 4, encrypt_key, nonce, store), 1);
+        assert_int_equal(btree_retrieve(9990, &found, store), 0);
+        assert_int_equal(btree_retrieve(10000, &found, store), 1);
+        for (int i = 9000; i < 10000; i += 3){
+            assert_int_equal(btree_delete(i, store), 0);
+        }
+        for (int i = 0; i < 10000; i++){
+            assert_int_equal(btree_decrypt(i, output, store), i >= 9000 && i % 3 == 0);
+        }
+        for (int i = 20000; i > 10000; i--){
+            assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, store), 0);
+        }
+        for (int i = 10001; i <= 20000; i++){
+            assert_int_equal(btree_retrieve(i, &found, store), 0);
+        }
+        close_store(store);
+    }
+}
+
+// Appends at either edge leave the nodes behind them nearly full, random inserts split in the middle
+static void append_splits_fill_nodes(void **state){
+    struct tree_stats sequential;
+    struct tree_stats descending;
+    struct tree_stats random;
+    struct info found;
+    void * stores[3];
+    for (int s = 0; s < 3; s++){
+        stores[s] = init_store(64, 4);
+    }
+
+    for (int i = 0; i < 20000; i++){
+        assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, stores[0]), 0);
+        assert_int_equal(btree_insert(20000 - i, "abc", 4, encrypt_key, nonce, stores[1]), 0);
+        // 7919 is prime, so this visits every key once in a scattered order
+        assert_int_equal(btree_insert((i * 7919) % 20000, "abc", 4, encrypt_key, nonce, stores[2]), 0);
+    }
+    btree_tree_stats(stores[0], &sequential);
+    btree_tree_stats(stores[1], &descending);
+    btree_tree_stats(stores[2], &random);
+
+    assert_int_equal(sequential.num_keys, 20000);
+    assert_true(sequential.leaf_fill_factor > 0.85);
+    assert_true(descending.leaf_fill_factor > 0.85);
+    assert_true(random.leaf_fill_factor < 0.85);
+    assert_true(sequential.num_nodes < random.num_nodes);
+    assert_true(sequential.append_splits > 0);
+
+    // the nodes left at the edges are small, deletes still rebalance them
+    for (int i = 0; i < 20000; i += 2){
+        assert_int_equal(btree_delete(i, stores[0]), 0);
+    }
+    for (int i = 0; i < 20000; i++){
+        assert_int_equal(btree_retrieve(i, &found, stores[0]), (i + 1) % 2);
+    }
+    for (int s = 0; s < 3; s++){
+        close_store(stores[s]);
+    }
+}
+
+// A tombstone delete leaves the tree as it is, the key is gone for readers until it is inserted again
+static void tombstone_deletes(void **state){
+    struct store_config configs[2] = {
+        {4, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 0, 1},
+        {4, 4, STORE_BPLUS_TREE, 3, STORE_ENCRYPTED, 0, 1}};
+    struct tree_stats stats;
+    struct info found;
+    btree_key_t keys[2000];
+    char output[40];
+
+    for (int c = 0; c < 2; c++){
+        void * store = init_store_with_config(&configs[c]);
+        for (int i = 0; i < 2000; i++){
+            assert_int_equal(btree_insert(i, "a value of thirty-two bytes ....", 32, encrypt_key, nonce, store), 0);
+        }
+        // below TOMBSTONE_BATCH nothing moves while deletes keep coming
+        uint64_t version = ((struct store_header *) store) -> structure_version;
+        for (int i = 0; i < 2000; i++){
+            if (i % 4 != 0){
+                assert_int_equal(btree_delete((i * 7) % 2000, store), 0);
+            }
+            if (i == 100){
+                assert_int_equal(((struct store_header *) store) -> structure_version, version);
+            }
+        }
+        assert_int_equal(btree_delete(1, store), 1);
+        assert_int_equal(btree_update(1, "abc", 4, encrypt_key, nonce, store), 1);
+        assert_int_equal(btree_scan(0, keys, 2000, store), 500);
+        for (int i = 0; i < 500; i++){
+            assert_true(keys[i] == (btree_key_t) (i * 4));
+        }
+
+        // back to life in its old slot
+        assert_int_equal(btree_insert(1, "abc", 4, encrypt_key, nonce, store), 0);
+        assert_int_equal(btree_decrypt(1, output, store), 0);
+        assert_string_equal(output, "abc");
+
+        btree_purge(store);
+        btree_tree_stats(store, &stats);
+        assert_int_equal(stats.tombstones, 0);
+        assert_int_equal(stats.num_nodes, ((struct store_header *) store) -> num_nodes);
+        for (int i = 0; i < 2000; i++){
+            assert_int_equal(btree_retrieve(i, &found, store), i % 4 != 0 && i != 1);
+        }
+        for (int i = 0; i < 2000; i += 4){
+            assert_int_equal(btree_decrypt(i, output, store), 0);
+            assert_memory_equal(output, "a value of thirty-two bytes ....", 32);
+        }
+        close_store(store);
+    }
+}
+
+// Deleting and inserting the same keys again merges and splits the same nodes, a lower watermark does not
+static void merge_watermark_stops_thrashing(void **state){
+    struct store_config configs[4] = {
+        {8, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 0, 0, 0},
+        {8, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 0, 0, 25},
+        {8, 4, STORE_BPLUS_TREE, 8, STORE_ENCRYPTED, 0, 0, 0},
+        {8, 4, STORE_BPLUS_TREE, 8, STORE_ENCRYPTED, 0, 0, 25}};
+    uint64_t changes[4];
+    struct tree_stats before;
+    struct tree_stats after;
+    struct info found;
+
+    for (int c = 0; c < 4; c++){
+        void * store = init_store_with_config(&configs[c]);
+        for (int i = 0; i < 4000; i++){
+            assert_int_equal(btree_insert((i * 7919) % 4000, "abc", 4, encrypt_key, nonce, store), 0);
+        }
+        btree_tree_stats(store, &before);
+        for (int round = 0; round < 50; round++){
+            for (int i = 1000; i < 1100; i += 2){
+                assert_int_equal(btree_delete(i, store), 0);
+            }
+            for (int i = 1000; i < 1100; i += 2){
+                assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, store), 0);
+            }
+        }
+        btree_tree_stats(store, &after);
+        assert_int_equal(after.inserts - before.inserts, 2500);
+        assert_int_equal(after.deletes - before.deletes, 2500);
+        changes[c] = after.splits + after.merges - before.splits - before.merges;
+        for (int i = 0; i < 4000; i++){
+            assert_int_equal(btree_retrieve(i, &found, store), 0);
+        }
+        close_store(store);
+    }
+    assert_true(changes[1] < changes[0]);
+    assert_true(changes[3] < changes[2]);
+}
+
+// The export is one block in preorder, each node's keys right after the previous node's
+static void export_single_block(void **state){
+    struct node * list = NULL;
+    struct tree_stats stats;
+
+    // an empty store, then an empty root
+    assert_int_equal(btree_export(*state, &list), 0);
+    assert_int_equal(btree_insert(1, "abc", 4, encrypt_key, nonce, *state), 0);
+    assert_int_equal(btree_delete(1, *state), 0);
+    assert_int_equal(btree_export(*state, &list), 1);
+    assert_int_equal(list -> num_keys, 0);
+    free(list);
+
+    for (int i = 0; i < 100000; i++){
+        assert_int_equal(btree_insert((i * 7919) % 100000, "abc", 4, encrypt_key, nonce, *state), 0);
+    }
+    btree_tree_stats(*state, &stats);
+    uint64_t num_nodes = btree_export(*state, &list);
+    assert_int_equal(num_nodes, stats.num_nodes);
+    // the root holds the median keys, its first subtree the smallest
+    assert_true(list -> keys[0] > (list + 1) -> keys[0]);
+    uint64_t num_keys = 0;
+    for (uint64_t i = 0; i < num_nodes; i++){
+        struct node * n = list + i;
+        assert_true(n -> num_keys > 0);
+        if (i + 1 < num_nodes){
+            assert_ptr_equal(n -> keys + n -> num_keys, (n + 1) -> keys);
+        }
+        for (uint16_t j = 1; j < n -> num_keys; j++){
+            assert_true(n -> keys[j - 1] < n -> keys[j]);
+        }
+        num_keys += n -> num_keys;
+    }
+    assert_int_equal(num_keys, 100000);
+    free(list);
+}
+
+// What the stream callbacks saw, the nodes' keys one after the other like btree_export lays them out
+struct streamed {
+    uint64_t num_nodes;
+    uint64_t num_keys;
+    uint64_t stop_after;
+    void * split_store;             // inserted into from the callback, to split nodes between pages
+    uint16_t depths[8192];
+    uint16_t sizes[8192];
+    btree_key_t first_keys[8192];
+    btree_key_t keys[40000];
+};
+
+static int collect_streamed(const struct node * node, uint16_t depth, void * context){
+    struct streamed * seen = (struct streamed *) context;
+    if (seen -> num_nodes < 8192){
+        seen -> depths[seen -> num_nodes] = depth;
+        seen -> sizes[seen -> num_nodes] = node -> num_keys;
+        seen -> first_keys[seen -> num_nodes] = node -> keys[0];
+    }
+    for (uint16_t i = 0; i < node -> num_keys && seen -> num_keys < 40000; i++){
+        seen -> keys[seen -> num_keys++] = node -> keys[i];
+    }
+    seen -> num_nodes += 1;
+    if (seen -> split_store != NULL && seen -> num_nodes == 1){
+        for (int i = 40000; i < 40100; i++){
+            btree_insert(i, "a", 2, encrypt_key, nonce, seen -> split_store);
+        }
+    }
+    return seen -> num_nodes == seen -> stop_after;
+}
+
+void * insert_above_thread(void * argv){
+    for (int i = 20000; i < 40000; i++){
+        btree_insert(i, "a", 2, encrypt_key, nonce, argv);
+    }
+    return NULL;
+}
+
+// The stream hands out what btree_export lists, page by page, and lets writers in while it runs
+static void streaming_export(void **state){
+    struct streamed * seen = (struct streamed *) calloc(1, sizeof(struct streamed));
+    struct node * list = NULL;
+    pthread_t writer;
+
+    assert_int_equal(btree_export_stream(*state, EXPORT_PREORDER, &collect_streamed, seen), 0);
+    assert_int_equal(seen -> num_nodes, 0);
+    for (int i = 0; i < 10000; i++){
+        assert_int_equal(btree_insert((i * 7919) % 10000, "abc", 4, encrypt_key, nonce, *state), 0);
+    }
+
+    uint64_t num_nodes = btree_export(*state, &list);
+    assert_true(num_nodes > EXPORT_PAGE_NODES && num_nodes <= 8192);
+    assert_int_equal(btree_export_stream(*state, EXPORT_PREORDER, &collect_streamed, seen), 0);
+    assert_int_equal(seen -> num_nodes, num_nodes);
+    assert_int_equal(seen -> num_keys, 10000);
+    assert_memory_equal(seen -> keys, list -> keys, 10000 * sizeof(btree_key_t));
+    for (uint64_t i = 0; i < num_nodes; i++){
+        assert_int_equal(seen -> sizes[i], (list + i) -> num_keys);
+    }
+    free(list);
+
+    // level by level, the leaves last
+    memset(seen, '\0', sizeof(struct streamed));
+    assert_int_equal(btree_export_stream(*state, EXPORT_LEVEL_ORDER, &collect_streamed, seen), 0);
+    assert_int_equal(seen -> num_nodes, num_nodes);
+    assert_int_equal(seen -> depths[0], 0);
+    for (uint64_t i = 1; i < num_nodes; i++){
+        assert_true(seen -> depths[i - 1] <= seen -> depths[i]);
+        if (seen -> depths[i - 1] == seen -> depths[i]){
+            assert_true(seen -> first_keys[i - 1] < seen -> first_keys[i]);
+        }
+    }
+
+    memset(seen, '\0', sizeof(struct streamed));
+    seen -> stop_after = 3;
+    assert_int_equal(btree_export_stream(*state, EXPORT_LEVEL_ORDER, &collect_streamed, seen), 1);
+    assert_int_equal(seen -> num_nodes, 3);
+
+    // keys come in order while a writer adds keys after them, the stream sees the tree as it was when it started
+    memset(seen, '\0', sizeof(struct streamed));
+    pthread_create(&writer, NULL, &insert_above_thread, *state);
+    assert_int_equal(btree_export_stream(*state, EXPORT_KEY_ORDER, &collect_streamed, seen), 0);
+    pthread_join(writer, NULL);
+    assert_true(seen -> num_keys >= 10000);
+    for (uint64_t i = 0; i < seen -> num_keys; i++){
+        assert_true(i >= 10000 || seen -> keys[i] == (btree_key_t) i);
+        assert_true(i == 0 || seen -> keys[i - 1] < seen -> keys[i]);
+    }
+
+    // a writer that splits nodes between pages does not stop a node walk, it sees the nodes from the start
+    uint64_t nodes_before = ((struct store_header *) *state) -> num_nodes;
+    uint64_t keys_before = btree_scan(0, seen -> keys, 40000, *state);
+    memset(seen, '\0', sizeof(struct streamed));
+    seen -> split_store = *state;
+    assert_int_equal(btree_export_stream(*state, EXPORT_PREORDER, &collect_streamed, seen), 0);
+    assert_int_equal(seen -> num_nodes, nodes_before);
+    assert_int_equal(seen -> num_keys, keys_before);
+    assert_true(((struct store_header *) *state) -> num_nodes > nodes_before);
+    assert_int_equal(btree_verify(*state), 0);
+    free(seen);
+}
+
+// Walking the subtrees of the root in parallel gives the export of a single thread, verify finds broken trees
+static void parallel_export_and_verify(void **state){
+    struct store_config configs[4] = {
+        {4, 1, STORE_BTREE, 0},
+        {4, 4, STORE_BTREE, 0},
+        {4, 1, STORE_BPLUS_TREE, 4},
+        {4, 4, STORE_BPLUS_TREE, 4}};
+    void * stores[4];
+    struct node * lists[4];
+    uint64_t num_nodes[4];
+
+    for (int c = 0; c < 4; c++){
+        stores[c] = init_store_with_config(&configs[c]);
+        assert_int_equal(btree_verify(stores[c]), 0);
+        for (int i = 0; i < 30000; i++){
+            assert_int_equal(btree_insert((i * 7919) % 30000, "abc", 4, encrypt_key, nonce, stores[c]), 0);
+        }
+        for (int i = 0; i < 30000; i += 3){
+            assert_int_equal(btree_delete(i, stores[c]), 0);
+        }
+        assert_true(((struct store_header *) stores[c]) -> num_nodes > PARALLEL_WALK_MIN_NODES);
+        assert_int_equal(btree_verify(stores[c]), 0);
+        num_nodes[c] = btree_export(stores[c], &lists[c]);
+
+        // the keys fill the list to its end, it is sized by the live keys and not by the fan-out
+        struct node * last = lists[c] + num_nodes[c] - 1;
+        size_t end = (char *) (last -> keys + last -> num_keys) - (char *) lists[c];
+        assert_true(end <= malloc_usable_size(lists[c]) && malloc_usable_size(lists[c]) - end < 32);
+    }
+
+    for (int c = 1; c < 4; c += 2){
+        assert_int_equal(num_nodes[c], num_nodes[c - 1]);
+        for (uint64_t i = 0; i < num_nodes[c]; i++){
+            struct node * n = lists[c] + i;
+            assert_int_equal(n -> num_keys, (lists[c - 1] + i) -> num_keys);
+            assert_memory_equal(n -> keys, (lists[c - 1] + i) -> keys, n -> num_keys * sizeof(btree_key_t));
+            if (i + 1 < num_nodes[c]){
+                assert_ptr_equal(n -> keys + n -> num_keys, (n + 1) -> keys);
+            }
+        }
+    }
+
+    // a key out of order in the last leaf, then a leaf list that skips a leaf
+    for (int c = 1; c < 4; c += 2){
+        struct store_header * store = (struct store_header *) stores[c];
+        Btree_Node * leaf = store -> root;
+        while (leaf -> num_children != 0){
+            leaf = node_at(store -> nodes, *(leaf -> children + leaf -> num_children - 1));
+        }
+        btree_key_t key = *(leaf -> keys);
+        *(leaf -> keys) = *(leaf -> keys + 1);
+        assert_int_equal(btree_verify(stores[c]), 1);
+        *(leaf -> keys) = key;
+        assert_int_equal(btree_verify(stores[c]), 0);
+        if (store -> mode == STORE_BPLUS_TREE){
+            Btree_Node * before = node_at(store -> nodes, leaf -> prev_leaf);
+            before -> next_leaf = NO_NODE;
+            assert_int_equal(btree_verify(stores[c]), 1);
+            before -> next_leaf = leaf -> index;
+            assert_int_equal(btree_verify(stores[c]), 0);
+        }
+    }
+
+    for (int c = 0; c < 4; c++){
+        free(lists[c]);
+        close_store(stores[c]);
+    }
+}
+
+void * read_snapshot_thread(void * argv){
+    char output[32];
+    for (int round = 0; round < 3; round++){
+        for (int i = 0; i < 4000; i++){
+            assert_int_equal(btree_decrypt(i, output, argv), 0);
+            assert_memory_equal(output, "old value, old value, old value", 32);
+        }
+    }
+    return NULL;
+}
+
+// Copies every chunk of the store from under another snapshot, then releases it, from inside a stream
+static int release_while_streaming(const struct node * node, uint16_t depth, void * context){
+    void ** stores = (void **) context;
+    if (stores[1] != NULL){
+        for (int i = 0; i < 4000; i += 2){
+            btree_update(i, "newer value, newer value, newer", 32, encrypt_key, nonce, stores[0]);
+        }
+        btree_snapshot_release(stores[1]);
+        stores[1] = NULL;
+    }
+    return 0;
+}
+
+// A snapshot keeps the tree and the values as they were, while the store goes on changing under it
+static void snapshot_keeps_old_version(void **state){
+    struct store_config configs[2] = {
+        {4, 4, STORE_BTREE, 0},
+        {4, 4, STORE_BPLUS_TREE, 4}};
+    btree_key_t keys[5000];
+    struct tree_stats before;
+    struct tree_stats after;
+    struct node * list = NULL;
+    char output[32];
+    pthread_t reader;
+
+    for (int c = 0; c < 2; c++){
+        void * store = init_store_with_config(&configs[c]);
+        for (int i = 0; i < 4000; i++){
+            assert_int_equal(btree_insert((i * 7919) % 4000, "old value, old value, old value", 32, encrypt_key, nonce, store), 0);
+        }
+        btree_tree_stats(store, &before);
+        void * snapshot = btree_snapshot(store);
+
+        // a reader without the lock while nodes split, merge and get copied
+        pthread_create(&reader, NULL, &read_snapshot_thread, snapshot);
+        for (int i = 0; i < 4000; i += 2){
+            assert_int_equal(btree_delete(i, store), 0);
+        }
+        for (int i = 1; i < 4000; i += 2){
+            assert_int_equal(btree_update(i, "new value, new value, new value", 32, encrypt_key, nonce, store), 0);
+        }
+        for (int i = 4000; i < 8000; i++){
+            assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, store), 0);
+        }
+        btree_compact(store);
+        pthread_join(reader, NULL);
+
+        assert_int_equal(btree_insert(9000, "abc", 4, encrypt_key, nonce, snapshot), 1);
+        assert_int_equal(btree_delete(1, snapshot), 1);
+        assert_int_equal(btree_update(1, "abc", 4, encrypt_key, nonce, snapshot), 1);
+        assert_int_equal(btree_verify(snapshot), 0);
+        btree_tree_stats(snapshot, &after);
+        assert_int_equal(after.num_nodes, before.num_nodes);
+        assert_int_equal(after.num_keys, before.num_keys);
+        assert_int_equal(btree_scan(0, keys, 5000, snapshot), 4000);
+        for (int i = 0; i < 4000; i++){
+            assert_true(keys[i] == (btree_key_t) i);
+        }
+        assert_int_equal(btree_export(snapshot, &list), before.num_nodes);
+        free(list);
+
+        assert_int_equal(btree_verify(store), 0);
+        assert_int_equal(btree_scan(0, keys, 5000, store), 5000);
+        assert_int_equal(btree_decrypt(0, output, store), 1);
+        assert_int_equal(btree_decrypt(1, output, store), 0);
+        assert_memory_equal(output, "new value, new value, new value", 32);
+
+        btree_snapshot_release(snapshot);
+        assert_int_equal(((struct store_header *) store) -> nodes -> snapshots, 0);
+
+        // the chunks a stream walks stay until it is done, whatever happens to other snapshots
+        void * stores[2] = {store, btree_snapshot(store)};
+        assert_int_equal(btree_export_stream(store, EXPORT_PREORDER, &release_while_streaming, stores), 0);
+        assert_null(stores[1]);
+        assert_int_equal(((struct store_header *) store) -> nodes -> snapshots, 0);
+        assert_int_equal(btree_verify(store), 0);
+        for (int i = 8000; i < 9000; i++){
+            assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, store), 0);
+        }
+        assert_int_equal(btree_verify(store), 0);
+        close_store(store);
+    }
+}
+
+// chunks of the store no longer the ones a snapshot of it started with
+static uint32_t chunks_copied(void * store, char ** shared, uint32_t num_shared){
+    struct node_arena * nodes = ((struct store_header *) store) -> nodes;
+    uint32_t copied = 0;
+    for (uint32_t c = 0; c < num_shared; c++){
+        copied += *(nodes -> chunks + c) != shared[c];
+    }
+    return copied;
+}
+
+// Fewer than TOMBSTONE_BATCH tombstones are removed once the store has been quiet for a while
+static void idle_store_purges_tombstones(void **state){
+    struct store_config configs[2] = {
+        {4, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 0, 1},
+        {4, 4, STORE_BPLUS_TREE, 3, STORE_ENCRYPTED, 0, 1}};
+    struct tree_stats stats;
+    struct info found;
+
+    for (int c = 0; c < 2; c++){
+        void * store = init_store_with_config(&configs[c]);
+        for (int i = 0; i < 1000; i++){
+            assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, store), 0);
+        }
+        for (int i = 0; i < TOMBSTONE_BATCH / 2; i++){
+            assert_int_equal(btree_delete(i * 7, store), 0);
+        }
+        btree_tree_stats(store, &stats);
+        assert_int_equal(stats.tombstones, TOMBSTONE_BATCH / 2);
+
+        // a few idle periods, given plenty of room on a slow machine
+        for (int wait = 0; wait < 500 && stats.tombstones != 0; wait++){
+            usleep(10000);
+            btree_tree_stats(store, &stats);
+        }
+        assert_int_equal(stats.tombstones, 0);
+        assert_int_equal(btree_verify(store), 0);
+        for (int i = 0; i < 1000; i++){
+            assert_int_equal(btree_retrieve(i, &found, store), i % 7 == 0 && i < TOMBSTONE_BATCH / 2 * 7);
+        }
+        close_store(store);
+    }
+}
+
+// Reading the store while a snapshot exists copies no chunk, only the nodes that are changed are copied
+static void snapshot_reads_copy_nothing(void **state){
+    struct store_config configs[2] = {
+        {4, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 10, 1},
+        {4, 4, STORE_BPLUS_TREE, 4, STORE_ENCRYPTED, 10, 1}};
+    btree_key_t keys[100];
+    struct tree_stats stats;
+    struct info found;
+    char ** shared = (char **) malloc(sizeof(char *) * 1024);
+
+    for (int c = 0; c < 2; c++){
+        void * store = init_store_with_config(&configs[c]);
+        for (int i = 0; i < 100000; i++){
+            assert_int_equal(btree_insert(i, "a value in the arena, not inline", 33, encrypt_key, nonce, store), 0);
+        }
+        assert_int_equal(btree_delete(50000, store), 0);
+        void * snapshot = btree_snapshot(store);
+        struct node_arena * nodes = ((struct store_header *) store) -> nodes;
+        uint32_t num_shared = nodes -> num_chunks;
+        assert_true(num_shared > 100 && num_shared <= 1024);
+        memcpy(shared, nodes -> chunks, sizeof(char *) * num_shared);
+
+        assert_int_equal(btree_scan(40000, keys, 100, store), 100);
+        assert_int_equal(btree_retrieve(70000, &found, store), 0);
+        btree_tree_stats(store, &stats);
+        filter_rebuild(store);
+        btree_compact(store);
+        assert_int_equal(btree_verify(store), 0);
+        assert_int_equal(chunks_copied(store, shared, num_shared), 0);
+
+        // purging the one tombstone copies the chunks on its path, not the tree
+        assert_int_equal(btree_purge(store), 1);
+        uint32_t copied = chunks_copied(store, shared, num_shared);
+        assert_true(copied > 0 && copied < 10);
+        btree_snapshot_release(snapshot);
+        close_store(store);
+    }
+    free(shared);
+}
+
+// A saved store loads back with the same keys, values and shape, and a damaged file does not load
+static void save_and_load(void **state){
+    struct store_config configs[2] = {
+        {5, 4, STORE_BTREE, 0, STORE_ENCRYPTED, 10, 1},
+        {6, 4, STORE_BPLUS_TREE, 4, STORE_ENCRYPTED, 0, 0, 25}};
+    const char * path = "tests_out/saved.store";
+    static char big[100026];
+    static char output[100000];
+    btree_key_t keys[3100];
+    struct tree_stats before;
+    struct tree_stats after;
+
+    for (int i = 0; i < 100026; i++){
+        big[i] = 'a' + i % 26;
+    }
+    for (int c = 0; c < 2; c++){
+        void * store = init_store_with_config(&configs[c]);
+        for (int i = 0; i < 3000; i++){
+            // inline values, values in the arena and a few with segments of their own
+            size_t count = i % 100 == 0 ? 100000 : i % 2 == 0 ? 4 + i % 5 : 32 + i % 40;
+            assert_int_equal(btree_insert(i, big + i % 26, count, encrypt_key, nonce + i, store), 0);
+        }
+        // the maintenance thread purges once TOMBSTONE_BATCH keys are deleted, fewer are left for the file
+        for (int i = 0; i < 2700; i += 3){
+            assert_int_equal(btree_delete(i, store), 0);
+        }
+        btree_purge(store);
+        for (int i = 2700; i < 3000; i += 3){
+            assert_int_equal(btree_delete(i, store), 0);
+        }
+        void * snapshot = btree_snapshot(store);
+        btree_tree_stats(snapshot, &before);
+        assert_int_equal(btree_save(path, snapshot), 0);
+        btree_snapshot_release(snapshot);
+
+        void * loaded = btree_load(path);
+        assert_non_null(loaded);
+        assert_int_equal(btree_verify(loaded), 0);
+        btree_tree_stats(loaded, &after);
+        assert_int_equal(after.num_nodes, before.num_nodes);
+        assert_int_equal(after.num_keys, before.num_keys);
+        assert_int_equal(after.tombstones, before.tombstones);
+        assert_int_equal(btree_scan(0, keys, 3100, loaded), 2000);
+        for (int i = 0; i < 3000; i++){
+            size_t count = i % 100 == 0 ? 100000 : i % 2 == 0 ? 4 + i % 5 : 32 + i % 40;
+            if (i % 3 == 0){
+                assert_int_equal(btree_decrypt(i, output, loaded), 1);
+                continue;
+            }
+            assert_int_equal(btree_decrypt(i, output, loaded), 0);
+            assert_memory_equal(output, big + i % 26, count);
+        }
+
+        // the loaded store is a store like any other
+        for (int i = 1; i < 3000; i += 3){
+            assert_int_equal(btree_delete(i, loaded), 0);
+        }
+        for (int i = 3000; i < 4000; i++){
+            assert_int_equal(btree_insert(i, "abc", 4, encrypt_key, nonce, loaded), 0);
+        }
+        btree_purge(loaded);
+        btree_compact(loaded);
+        assert_int_equal(btree_verify(loaded), 0);
+        assert_int_equal(btree_scan(0, keys, 3100, loaded), 2000);
+        assert_int_equal(btree_decrypt(2, output, loaded), 0);
+        assert_memory_equal(output, big + 2, 6);
+        close_store(loaded);
+        close_store(store);
+    }
+
+    // one byte changed, or another version of the format, and nothing is loaded
+    FILE * file = fopen(path, "r+b");
+    fseek(file, sizeof(struct save_header) + 100, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, sizeof(struct save_header) + 100, SEEK_SET);
+    fputc(byte ^ 1, file);
+    fclose(file);
+    assert_null(btree_load(path));
+
+    void * store = init_store(4, 4);
+    assert_int_equal(btree_insert(1, "abc", 4, encrypt_key, nonce, store), 0);
+    assert_int_equal(btree_save(path, store), 0);
+    struct save_header header;
+    file = fopen(path, "r+b");
+    assert_int_equal(fread(&header, sizeof(struct save_header), 1, file), 1);
+    header.format_version += 1;
+    header.header_checksum = checksum_bytes(&header, offsetof(struct save_header, header_checksum), 0);
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(struct save_header), 1, file);
+    fclose(file);
+    assert_null(btree_load(path));
+    assert_null(btree_load("tests_out/no_such.store"));
+
+    // a save that can not be written leaves the last good file where it was
+    assert_int_equal(btree_save(path, store), 0);
+    assert_int_equal(mkdir("tests_out/saved.store.tmp", 0700), 0);
+    assert_int_equal(btree_insert(2, "abc", 4, encrypt_key, nonce, store), 0);
+    assert_int_equal(btree_save(path, store), 1);
+    rmdir("tests_out/saved.store.tmp");
+    void * loaded = btree_load(path);
+    assert_non_null(loaded);
+    assert_int_equal(btree_scan(0, keys, 3100, loaded), 1);
+    close_store(loaded);
+    close_store(store);
+    remove(path);
+}
+
+// In B+tree mode every value is in a leaf, scans walk the leaf list and agree with the B-tree
+static void bplus_tree_mode(void **state){
+    struct store_config config = {4, 4, STORE_BPLUS_TREE, 3};
+    void * bplus = init_store_with_config(&config);
+    btree_key_t keys[1000];
+    char output[8];
+    struct info found;
+
+    for (int i = 0; i < 1000; i++){
+        btree_key_t key = (i * 7) % 1000;
+        assert_int_equal(btree_insert(key, "abcdefg", 8, encrypt_key, nonce, bplus), 0);
+        assert_int_equal(btree_insert(key, "abcdefg", 8, encrypt_key, nonce, *state), 0);
+    }
+    for (int i = 0; i < 1000; i += 2){
+        assert_int_equal(btree_delete(i, bplus), 0);
+        assert_int_equal(btree_delete(i, *state), 0);
+    }
+    assert_int_equal(btree_delete(0, bplus), 1);
+
+    // internal nodes only hold separators
+    Btree_Node * root = ((struct store_header *) bplus) -> root;
+    assert_null(root -> keys_info);
+
+    assert_int_equal(btree_scan(0, keys, 1000, bplus), 500);
+    for (int i = 0; i < 500; i++){
+        assert_int_equal(keys[i], 2 * i + 1);
+    }
+    assert_int_equal(btree_scan(0, keys, 1000, *state), 500);
+    assert_int_equal(keys[499], 999);
+    assert_int_equal(btree_scan(500, keys, 10, bplus), 10);
+    assert_int_equal(keys[0], 501);
+    assert_int_equal(btree_scan(500, keys, 10, *state), 10);
+    assert_int_equal(keys[9], 519);
+
+    for (int i = 1; i < 1000; i += 2){
+        assert_int_equal(btree_retrieve(i, &found, bplus), 0);
+        assert_int_equal(btree_decrypt(i, output, bplus), 0);
+        assert_string_equal(output, "abcdefg");
+    }
+    assert_int_equal(btree_retrieve(2, &found, bplus), 1);
+    close_store(bplus);
+}
+
+// The node counter of the store header is 64 bits, a store keeps working past 65,535 nodes
+static void more_than_65535_nodes(void **state){
+    void * store = init_store(3, 4);
+    struct info found;
+    for (uint32_t i = 0; i < 150000; i++){
+        assert_int_equal(btree_insert(i, "a", 1, encrypt_key, nonce, store), 0);
+    }
+    assert_true(((struct store_header *) store) -> num_nodes > 65535);
+    for (uint32_t i = 0; i < 150000; i += 997){
+        assert_int_equal(btree_retrieve(i, &found, store), 0);
+        assert_int_equal(found.size, 1);
+    }
+    for (uint32_t i = 0; i < 150000; i++){
+        assert_int_equal(btree_delete(i, store), 0);
+    }
+    assert_int_equal(((struct store_header *) store) -> num_nodes, 1);
+    close_store(store);
+}
+
+// A node too big to share a chunk gets one of its own, index 0 still leaves its chunk unused
+static void one_node_per_chunk(void **state){
+    void * store = init_store(1024, 4);
+    struct info found;
+    assert_int_equal(((struct store_header *) store) -> nodes -> nodes_per_chunk, 1);
+    for (uint32_t i = 0; i < 5000; i++){
+        assert_int_equal(btree_insert(i, "a", 2, encrypt_key, nonce, store), 0);
+    }
+    assert_true(((struct store_header *) store) -> num_nodes > 1);
+    assert_int_equal(btree_verify(store), 0);
+    for (uint32_t i = 0; i < 5000; i += 7){
+        assert_int_equal(btree_retrieve(i, &found, store), 0);
+    }
+    close_store(store);
+}
+
+// key_info is stored in the nodes, it must move with its key through splits, borrows and merges
+static void retrieve_info_after_rebalance(void **state){
+    struct info found;
+    for (int i = 0; i < 500; i++){
+        btree_insert(i, "abcdefghijklmnopqrstuvwxyz", 1 + i % 26, encrypt_key, nonce + i, *state);
+    }
+    for (int i = 0; i < 500; i += 3){
+        btree_delete(i, *state);
+    }
+    for (int i = 0; i < 500; i++){
+        if (i % 3 == 0){
+            assert_int_equal(btree_retrieve(i, &found, *state), 1);
+            continue;
+        }
+        assert_int_equal(btree_retrieve(i, &found, *state), 0);
+        assert_int_equal(found.size, 1 + i % 26);
+        assert_true(found.nonce == nonce + i);
+        assert_memory_equal(found.key, encrypt_key, sizeof(encrypt_key));
+    }
+}
 
 
 int main(void) {
@@ -377,6 +1564,34 @@ int main(void) {
           cmocka_unit_test_setup_teardown(multithreaded_retrieve, setup, teardown),
           cmocka_unit_test_setup_teardown(multithreaded_insert_delete, setup, teardown),
           cmocka_unit_test_setup_teardown(multithreaded_combination_huge, setup, teardown),
+          cmocka_unit_test_setup_teardown(search_keys_agree, setup, teardown),
+          cmocka_unit_test_setup_teardown(wide_node_insert_retrieve_delete, setup, teardown),
+          cmocka_unit_test_setup_teardown(random_insert_delete, setup, teardown),
+          cmocka_unit_test_setup_teardown(node_arena_indices, setup, teardown),
+          cmocka_unit_test_setup_teardown(arena_compaction, setup, teardown),
+          cmocka_unit_test_setup_teardown(inline_small_values, setup, teardown),
+          cmocka_unit_test_setup_teardown(bplus_tree_mode, setup, teardown),
+          cmocka_unit_test_setup_teardown(more_than_65535_nodes, setup, teardown),
+          cmocka_unit_test_setup_teardown(one_node_per_chunk, setup, teardown),
+          cmocka_unit_test_setup_teardown(retrieve_info_after_rebalance, setup, teardown),
+          cmocka_unit_test_setup_teardown(keys_use_full_width, setup, teardown),
+          cmocka_unit_test_setup_teardown(plaintext_values, setup, teardown),
+          cmocka_unit_test_setup_teardown(update_and_upsert, setup, teardown),
+          cmocka_unit_test_setup_teardown(value_handles, setup, teardown),
+          cmocka_unit_test_setup_teardown(handle_holds_only_its_entry, setup, teardown),
+          cmocka_unit_test_setup_teardown(update_reuses_entry, setup, teardown),
+          cmocka_unit_test_setup_teardown(membership_filter, setup, teardown),
+          cmocka_unit_test_setup_teardown(finger_for_sequential_inserts, setup, teardown),
+          cmocka_unit_test_setup_teardown(append_splits_fill_nodes, setup, teardown),
+          cmocka_unit_test_setup_teardown(tombstone_deletes, setup, teardown),
+          cmocka_unit_test_setup_teardown(idle_store_purges_tombstones, setup, teardown),
+          cmocka_unit_test_setup_teardown(merge_watermark_stops_thrashing, setup, teardown),
+          cmocka_unit_test_setup_teardown(export_single_block, setup, teardown),
+          cmocka_unit_test_setup_teardown(streaming_export, setup, teardown),
+          cmocka_unit_test_setup_teardown(parallel_export_and_verify, setup, teardown),
+          cmocka_unit_test_setup_teardown(snapshot_keeps_old_version, setup, teardown),
+          cmocka_unit_test_setup_teardown(snapshot_reads_copy_nothing, setup, teardown),
+          cmocka_unit_test_setup_teardown(save_and_load, setup, teardown),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);